@@ -0,0 +1,61 @@
+/** CRC-16/Modbus for AVR8 and host
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <inttypes.h>
+
+/* CRC-16/Modbus.  Reflected polynomial 0xA001, initial value 0xffff.
+ *
+ * Three equivalent implementations are provided.
+ *
+ *  bitwise - 8 shift/xor per byte.  No table.  (reference)
+ *  nibble  - 2 lookups per byte in a 16 entry (32 byte) table.
+ *  table   - 1 lookup per byte in a 256 entry (512 byte) table.
+ *
+ * On AVR the tables are kept in flash.
+ *
+ * CRC16_METHOD selects which is used by crc16_update()
+ * and calculate_crc().
+ */
+#define CRC16_BITWISE 0
+#define CRC16_NIBBLE  1
+#define CRC16_TABLE   2
+
+#ifndef CRC16_METHOD
+#  define CRC16_METHOD CRC16_TABLE
+#endif
+
+uint16_t crc16_update_bitwise(uint16_t crc, uint8_t data);
+uint16_t crc16_update_nibble(uint16_t crc, uint8_t data);
+uint16_t crc16_update_table(uint16_t crc, uint8_t data);
+
+#if CRC16_METHOD==CRC16_BITWISE
+#  define crc16_update crc16_update_bitwise
+#elif CRC16_METHOD==CRC16_NIBBLE
+#  define crc16_update crc16_update_nibble
+#elif CRC16_METHOD==CRC16_TABLE
+#  define crc16_update crc16_update_table
+#else
+#  error Unknown CRC16_METHOD
+#endif
+
+//! CRC of a complete buffer
+uint16_t calculate_crc(const uint8_t* d, uint8_t c);
+
+#endif // CRC16_H
@@ -0,0 +1,236 @@
+/** CRC-16/Modbus benchmark
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Cross check all CRC implementations against the bitwise
+ * reference, then time each.
+ *
+ * On the host, report ns/byte.
+ * On AVR, count CPU cycles with Timer1 and report cycles/byte
+ * on the UART (115200 8N1).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "crc16.h"
+
+#define NELEMENTS(X) (sizeof(X)/sizeof(*(X)))
+
+typedef uint16_t (*crc_fn)(uint16_t, uint8_t);
+
+static const struct {
+    const char *name;
+    crc_fn fn;
+} variants[] = {
+    {"bitwise", crc16_update_bitwise},
+    {"nibble",  crc16_update_nibble},
+    {"table",   crc16_update_table},
+};
+
+#ifdef __AVR__
+#  define BENCH_SIZE 64
+#else
+#  define BENCH_SIZE 4096
+#endif
+
+static uint8_t data[BENCH_SIZE];
+
+static uint16_t run(crc_fn fn, const uint8_t *d, uint16_t n)
+{
+    uint16_t r=0xffff;
+    while(n--)
+        r=fn(r, *d++);
+    return r;
+}
+
+/* Compare each variant with the reference for every single byte
+ * from a few starting values, and over the whole data buffer.
+ * Returns the number of mis-matches.
+ */
+static unsigned check(crc_fn fn)
+{
+    static const uint16_t init[] = {0x0000, 0xffff, 0x1234, 0xa001};
+    static const uint8_t std[] = "123456789";
+    unsigned i, j, nbad = 0;
+
+    for(i=0; i<NELEMENTS(init); i++) {
+        for(j=0; j<256; j++) {
+            if(fn(init[i], j)!=crc16_update_bitwise(init[i], j))
+                nbad++;
+        }
+    }
+
+    if(run(fn, data, sizeof(data))!=run(crc16_update_bitwise, data, sizeof(data)))
+        nbad++;
+
+    // CRC-16/MODBUS check value
+    if(run(fn, std, sizeof(std)-1)!=0x4b37)
+        nbad++;
+
+    return nbad;
+}
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+
+static inline void setupuart(void)
+{
+#define BAUD_TOL 3
+#define BAUD 115200
+#include <util/setbaud.h>
+    UBRR0H = UBRRH_VALUE;
+    UBRR0L = UBRRL_VALUE;
+#if USE_2X
+    UCSR0A = _BV(U2X0);
+#else
+    UCSR0A = 0;
+#endif
+    /* 8 N 1 */
+    UCSR0C = _BV(UCSZ00)|_BV(UCSZ01);
+    /* Enable Tx/Rx */
+    UCSR0B = _BV(TXEN0)|_BV(RXEN0);
+#undef BAUD
+#undef BAUD_TOL
+#ifdef USE_2X
+#  undef USE_2X
+#endif
+}
+
+static
+void put_char(uint8_t c)
+{
+    loop_until_bit_is_set(UCSR0A, UDRE0);
+    UDR0 = c;
+}
+
+static
+void put_str(const char *s)
+{
+    while(*s)
+        put_char(*s++);
+}
+
+static
+void put_dec(uint16_t v)
+{
+    char b[6];
+    uint8_t n = 0;
+    do {
+        b[n++] = '0' + v%10;
+        v /= 10;
+    } while(v);
+    while(n)
+        put_char(b[--n]);
+}
+
+int main(void) __attribute__ ((OS_main));
+int main(void)
+{
+    uint8_t i;
+    uint16_t n;
+
+    setupuart();
+
+    for(n=0; n<sizeof(data); n++)
+        data[n] = n*7+3;
+
+    // Timer1 counts CPU cycles
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+
+    while(1) {
+        for(i=0; i<NELEMENTS(variants); i++) {
+            uint16_t start, cycles;
+            volatile uint16_t sink;
+
+            put_str(variants[i].name);
+            put_str(check(variants[i].fn) ? " FAIL " : " ok ");
+
+            start = TCNT1;
+            sink = run(variants[i].fn, data, sizeof(data));
+            cycles = TCNT1 - start;
+            (void)sink;
+
+            // cycles/byte with one decimal place
+            cycles = (cycles*10ul + sizeof(data)/2)/sizeof(data);
+            put_dec(cycles/10);
+            put_char('.');
+            put_dec(cycles%10);
+            put_str(" cycles/byte\r\n");
+        }
+        put_str("\r\n");
+        {
+            // ~1 sec. pause
+            uint8_t j;
+            for(j=0; j<250; j++) {
+                TCNT1 = 0;
+                while(TCNT1<(F_CPU/250)) {}
+            }
+        }
+    }
+}
+
+#else /* !__AVR__ */
+
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned i, nrep = 2000, nfail = 0;
+    size_t n;
+
+    if(argc>1)
+        nrep = atoi(argv[1]);
+
+    srand(42);
+    for(n=0; n<sizeof(data); n++)
+        data[n] = rand();
+
+    for(i=0; i<NELEMENTS(variants); i++) {
+        unsigned nbad = check(variants[i].fn), r;
+        volatile uint16_t sink = 0;
+        double start, end;
+
+        start = now();
+        for(r=0; r<nrep; r++)
+            sink ^= run(variants[i].fn, data, sizeof(data));
+        end = now();
+        (void)sink;
+
+        printf("%-8s %s %6.2f ns/byte\n", variants[i].name,
+               nbad ? "FAIL" : "ok  ",
+               (end-start)/((double)nrep*sizeof(data)));
+
+        if(nbad)
+            nfail++;
+    }
+
+    printf("CRC16_METHOD=%d\n", CRC16_METHOD);
+
+    return nfail!=0;
+}
+
+#endif /* __AVR__ */
@@ -24,20 +24,13 @@
 
 static uint16_t data[4];
 
-void mbus_read_holding(uint16_t addr, uint8_t count, uint16_t * restrict result)
-{
-    if(addr>=4)
-        mbus_exception(2);
-    if(count>4 || addr+count>4)
-        mbus_exception(3);
+#define ECHO_REG(N) {.store=&data[N], .wmask=0xffff, .flags=MBUS_REG_RW}
 
-    memcpy(result, data+addr, 2*count);
-}
+static const struct mbus_reg regmap[4] MBUS_REGMAP = {
+    ECHO_REG(0), ECHO_REG(1), ECHO_REG(2), ECHO_REG(3),
+};
 
-void mbus_write_holding(uint16_t addr, uint16_t value)
+void user_init(void)
 {
-    if(addr>=4)
-        mbus_exception(2);
-
-    data[addr] = value;
+    mbus_set_regmap(regmap, 4);
 }
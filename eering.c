@@ -0,0 +1,99 @@
+/** Wear levelled EEPROM ring of snapshots
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+
+#include "crc16.h"
+#include "eering.h"
+
+#define EEADDR(A) ((const uint8_t*)(uintptr_t)(A))
+
+void eering_init(struct eering *R, uint16_t base, uint8_t nslot, uint8_t len)
+{
+    R->base = base;
+    R->nslot = nslot;
+    R->len = len;
+    R->next = 0;
+    R->seq = 0xffff; // next is 0
+}
+
+// Check one slot.  Returns 1 and its sequence number if valid.
+static uint8_t eering_check(const struct eering *R, uint8_t idx, uint16_t *seq)
+{
+    uint16_t addr = R->base + (uint16_t)idx*EERING_SLOT(R->len),
+             crc = 0xffff, stored;
+    uint8_t i, n = 2+R->len;
+
+    for(i=0; i<n; i++)
+        crc = crc16_update(crc, eeprom_read_byte(EEADDR(addr+i)));
+
+    stored = eeprom_read_byte(EEADDR(addr+n)) | eeprom_read_byte(EEADDR(addr+n+1))<<8;
+
+    *seq = eeprom_read_byte(EEADDR(addr)) | eeprom_read_byte(EEADDR(addr+1))<<8;
+
+    return crc==stored && *seq!=0xffff;
+}
+
+uint8_t eering_load(struct eering *R, void *data)
+{
+    uint8_t i, found = 0, best = 0;
+    uint16_t bestseq = 0;
+
+    for(i=0; i<R->nslot; i++) {
+        uint16_t seq;
+
+        if(!eering_check(R, i, &seq))
+            continue;
+
+        // newer, allowing for wrap around
+        if(!found || (int16_t)(seq-bestseq)>0) {
+            found = 1;
+            best = i;
+            bestseq = seq;
+        }
+    }
+
+    if(!found)
+        return 0;
+
+    eeprom_read_block(data, EEADDR(R->base + (uint16_t)best*EERING_SLOT(R->len) + 2), R->len);
+
+    R->seq = bestseq;
+    R->next = best+1==R->nslot ? 0 : best+1;
+    return 1;
+}
+
+uint16_t eering_pack(struct eering *R, const void *data, uint8_t *slot)
+{
+    uint16_t seq = R->seq+1, crc, addr;
+
+    if(seq==0xffff)
+        seq = 0;
+
+    slot[0] = seq;
+    slot[1] = seq>>8;
+    memcpy(slot+2, data, R->len);
+    crc = calculate_crc(slot, 2+R->len);
+    slot[2+R->len] = crc;
+    slot[3+R->len] = crc>>8;
+
+    addr = R->base + (uint16_t)R->next*EERING_SLOT(R->len);
+
+    R->seq = seq;
+    R->next = R->next+1==R->nslot ? 0 : R->next+1;
+    return addr;
+}
@@ -0,0 +1,75 @@
+/** Wear levelled EEPROM ring of snapshots
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef EERING_H
+#define EERING_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __AVR__
+#  include <avr/eeprom.h>
+#else
+// provided by the test program
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+#endif
+
+/* Ring of snapshot slots in EEPROM.
+ *
+ * Each save goes to the slot after the newest, so writes are spread
+ * over all slots.  A slot is
+ *
+ *   seq (2 bytes) | data (len bytes) | CRC-16 of seq and data (2 bytes)
+ *
+ * with multi-byte fields little endian.  Sequence numbers increase
+ * by one for each save, skipping 0xffff (erased).  An interrupted
+ * write leaves a slot with a bad CRC, and the previous snapshot
+ * is still found.
+ *
+ * This code only reads EEPROM.  Writing the slot image built by
+ * eering_pack() is left to the caller (eg. with eewrite.h).
+ */
+struct eering {
+    uint16_t base;  //!< EEPROM address of slot 0
+    uint8_t nslot;  //!< number of slots
+    uint8_t len;    //!< data bytes per slot
+    uint8_t next;   //!< slot to write next
+    uint16_t seq;   //!< sequence number of the newest slot
+};
+
+//! Bytes of EEPROM used by one slot
+#define EERING_SLOT(LEN) ((LEN)+4)
+
+void eering_init(struct eering *R, uint16_t base, uint8_t nslot, uint8_t len);
+
+/** @brief Find and read the newest valid slot
+ *
+ * Reads each slot once, then the newest again.  Returns 1
+ * and fills data[len] if one is found.  Returns 0 if no slot is valid,
+ * and data[] is unchanged.
+ */
+uint8_t eering_load(struct eering *R, void *data);
+
+/** @brief Build the next slot image
+ *
+ * Fills slot[EERING_SLOT(len)] with data and the next sequence number.
+ * Returns the EEPROM address at which it should be written.
+ */
+uint16_t eering_pack(struct eering *R, const void *data, uint8_t *slot);
+
+#endif // EERING_H
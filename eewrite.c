@@ -0,0 +1,73 @@
+/** Interrupt driven EEPROM writer for AVR8
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "eewrite.h"
+
+static uint8_t ee_buf[EEWRITE_MAX];
+static uint16_t ee_addr;
+static uint8_t ee_pos, ee_len;
+//! Cleared by ISR when the last byte is written
+static volatile uint8_t ee_busy;
+
+uint8_t eewrite_start(void *dst, const void *src, uint8_t n)
+{
+    if(ee_busy || n>EEWRITE_MAX)
+        return 1;
+
+    memcpy(ee_buf, src, n);
+    ee_addr = (uintptr_t)dst;
+    ee_pos = 0;
+    ee_len = n;
+    ee_busy = 1;
+
+    // fires at once if no write is in progress
+    EECR |= _BV(EERIE);
+    return 0;
+}
+
+uint8_t eewrite_busy(void)
+{
+    return ee_busy;
+}
+
+ISR(EE_READY_vect)
+{
+    // skip bytes which are unchanged
+    while(ee_pos<ee_len) {
+        uint8_t val = ee_buf[ee_pos];
+
+        EEAR = ee_addr+ee_pos++;
+        EECR |= _BV(EERE);
+        if(EEDR==val)
+            continue;
+
+        // erase and write.  EEPE must be set within 4 cycles of EEMPE
+        EEDR = val;
+        EECR |= _BV(EEMPE);
+        EECR |= _BV(EEPE);
+        return;
+    }
+
+    // done
+    EECR &= ~_BV(EERIE);
+    ee_busy = 0;
+}
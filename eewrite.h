@@ -0,0 +1,49 @@
+/** Interrupt driven EEPROM writer for AVR8
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef EEWRITE_H
+#define EEWRITE_H
+
+#include <inttypes.h>
+
+/* Writes a block to EEPROM from the EE_READY interrupt.
+ *
+ * The data is copied when the write is started, so the caller
+ * may reuse its buffer at once.  Bytes which already hold the
+ * new value are skipped, which saves time and wear.
+ *
+ * Each changed byte takes ~3.4ms, during which the rest of the
+ * program runs.  Other EEPROM access must wait until eewrite_busy()
+ * returns 0.
+ */
+
+//! Largest block which may be written
+#ifndef EEWRITE_MAX
+#  define EEWRITE_MAX 32
+#endif
+
+/** @brief Start writing n bytes from src to EEPROM at dst
+ *
+ * Returns 0 if the write was started.  Non-zero if the previous
+ * write is still in progress, or n>EEWRITE_MAX.
+ */
+uint8_t eewrite_start(void *dst, const void *src, uint8_t n);
+
+//! Non-zero while a write is in progress
+uint8_t eewrite_busy(void);
+
+#endif // EEWRITE_H
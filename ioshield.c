@@ -21,11 +21,16 @@
 #include <inttypes.h>
 
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
 
 #include "mbus.h"
+#include "server.h"
+#include "eewrite.h"
+#include "eering.h"
 
 #define NELEMENTS(X) (sizeof(X)/sizeof(*(X)))
 
@@ -55,11 +60,14 @@
  *  Reading:
  *   0x00FF - Reset source flags (AVR8 MCUSR at boot)
  *   0x0100 - Output enable status.  Outputs are tri-state when clear.
+ *   0x0400 - Save to eeprom in progress.
  *
  *  Writing:
  *   0x0001 - Reset.  Cause the Board to reset.  Not reply will be sent.
  *   0x0100 - Enable outputs.  Outputs are tri-state when clear.
- *   0x0200 - Save to eeprom.
+ *   0x0200 - Save to eeprom.  Registers are copied at once and
+ *            written in the background.  Exception 6 (busy), and
+ *            nothing changed, if the previous save is still in progress.
  *
  * 0x0001 - input/output register
  *
@@ -90,26 +98,140 @@
  *
  *  Reading:
  *   0xFFC0
+ *
+ * 0x000B - Modbus unit address (1-247, default 1)
+ *
+ *  The reply to this write still comes from the old address.
+ *  Save to eeprom to keep across reset.
+ *
+ * 0x000C - Last request to reply latency
+ * 0x000D - Max. request to reply latency
+ *
+ *  In units of 1024/F_CPU (64us at 16MHz).
+ *  Writing any value to 0x000D clears last, max, and the histogram.
+ *
+ * 0x000E-0x001D - Latency histogram
+ *
+ *  Count of replies in each bucket.  0x000E is within one tick,
+ *  and 0x000E+N is 2^(N-1) through 2^N-1 ticks.  0x001D also
+ *  counts anything longer.
+ *
+ * 0x0020-0x0027 - Input 1-4 pulse counts
+ *
+ *  Rising edges of each input.  32 bits, as two registers with the
+ *  high word first.  Writing either register clears the count.
+ *
+ * 0x0028-0x002F - Input 1-4 period
+ *
+ *  Time between the last two rising edges, in units of 8/F_CPU
+ *  (0.5us at 16MHz).  32 bits, high word first.  0 until two edges
+ *  are seen.  Input 2 uses Timer1 input capture while output 2 is
+ *  in immediate mode.  Otherwise, and for the other inputs, the
+ *  resolution is 64us and periods of more than ~4 seconds read as 0.
+ *
+ * 0x0030-0x0037 - Input 1-4 frequency
+ *
+ *  From the period.  In units of 0.01 Hz.  32 bits, high word first.
+ *
+ * 0x0038 - Input capture status
+ *
+ *  0x0002 - Input 2 period is from Timer1 input capture
+ *
+ * The input state, ADC, latency, and input count, period, and frequency
+ * registers of one read all come from a single sample taken at the start
+ * of the read.  So 32 bit values, and the histogram, are consistent.
+ *
+ * Registers 0x0006 through 0x000A, 0x000C, the histogram, and
+ * 0x0028 through 0x0038 are read only.  Writes to them are ignored,
+ * so a block write may span them.  Accessing 0x001E, 0x001F, or any
+ * address past 0x0038 is answered with exception 2.
+ */
+
+/** BNC I/O Shield coils and discrete inputs.
+ *
+ * Coils 0-3 - Outputs 1-4.  Same as the low bits of register 0x0001.
+ *             Writing a coil leaves the other outputs unchanged.
+ *
+ * Discrete inputs 0-3 - Inputs 1-4.  Current pin state.
+ *
+ * Access past coil or input 3 is answered with exception 2.
  */
 
-#define NREG 11
+/** BNC I/O Shield input edge FIFO.
+ *
+ * Each change of an input is recorded with the time it happened.
+ * Read with function 24 (Read FIFO Queue) at FIFO address 0x0000.
+ * Records read are removed.  Each record is two registers.
+ *
+ *  1st - Time in units of 1024/F_CPU (64us at 16MHz).  Wraps after
+ *        2^16 ticks, so read at least every 4 seconds.
+ *  2nd - 0x000F Input state after the change (Inputs 1-4, as discrete inputs)
+ *        0x0080 Records were lost before this one (FIFO full)
+ *
+ * Up to 31 records are kept.  One read returns at most 15 records,
+ * as function 24 is limited to 31 registers (with MAX_BUFFER>=62, as
+ * for uno).  So emptying a full FIFO takes 3 reads.  Read again while
+ * a reply has 15 records.
+ */
+
+//! Registers stored in reg[] (and eeprom)
+#define NREG 12
+//! Latency registers follow
+#define LAT_BASE NREG
+//! Input counters and periods, then frequencies, then status
+#define IN_BASE 0x20
+#define IN_NREG 16
+#define IN_FREQ (IN_BASE+IN_NREG)
+#define IN_STATUS (IN_FREQ+8)
+#define NMAP (IN_STATUS+1)
+
+#if LAT_BASE+SERVER_LAT_NREG > IN_BASE
+#  error Latency and input registers overlap
+#endif
 
 static uint16_t reg[NREG];
+//! Snapshot of input counts and periods, as 0x0020-0x002F
+static uint16_t inreg[IN_NREG];
+//! Snapshot of latency registers, as 0x000C-0x001D
+static uint16_t latreg[SERVER_LAT_NREG];
+
+/* Saved registers.  Each save goes to the next slot of a ring,
+ * to spread wear.  32 slots of 28 bytes.
+ */
+#define EE_NSLOT 32
+#define EE_SLOT EERING_SLOT(2*NREG)
+
+static uint8_t eereg[EE_NSLOT][EE_SLOT] EEMEM;
+static struct eering eering;
+
+#if EE_SLOT > EEWRITE_MAX
+#  error Saved registers must fit in EEWRITE_MAX
+#endif
 
-/* each block can hold a copy of registers and a checksum */
-static uint16_t eereg[NREG+1] EEMEM;
+static const struct mbus_reg regmap[NMAP] MBUS_REGMAP;
+static const struct mbus_ops ioshield_ops;
+static uint8_t read_pins(void);
+//! Input state at the previous pin change.  Only used by ISR
+static uint8_t edge_prev;
+static void icp_start(void);
+static void icp_stop(void);
 
 /* sequence to restore registers from eeprom */
-static uint8_t eereg_restore_seq[] = {3,5,2,4,1,0};
+static uint8_t eereg_restore_seq[] = {3,5,2,4,1,0,11};
 
 void user_init(void)
 {
-    uint16_t initreg[NREG+1], isum;
+    uint16_t initreg[NREG];
 
     reg[0] = MCUSR; // save reset source
 
     reg[6] = reg[8] = 10<<8; // outputs 3,4 only allow divider /1024
 
+    reg[11] = mbus_get_unit();
+
+    mbus_default.ops = &ioshield_ops;
+    mbus_set_regmap(regmap, NMAP);
+
     // Enable Tx/Rx control drivers
     PORTD = _BV(PD2)|_BV(PD3); // enable internal pull-ups
     DDRD = _BV(DDD2)|_BV(DDD3); // Set to outputs (level high)
@@ -121,20 +243,30 @@ void user_init(void)
     DDRB |= _BV(DDB2)|_BV(DDB3);
     DDRD |= _BV(DDD5)|_BV(DDD6);
 
+    // Pin change interrupts on inputs, for the edge FIFO and counters
+    edge_prev = read_pins()>>4;
+    PCMSK0 = _BV(PCINT0)|_BV(PCINT1);
+    PCMSK2 = _BV(PCINT20)|_BV(PCINT23);
+    PCICR = _BV(PCIE0)|_BV(PCIE2);
+
+    // output 2 starts in immediate mode
+    icp_start();
+
     // Ref is internal 1.1V. left shift.  Mux select 8 (temperature)
     ADMUX = _BV(REFS1)|_BV(REFS0) | _BV(ADLAR) | _BV(MUX3);
     // Enable and start.  Clock /128
     ADCSRA = _BV(ADEN)|_BV(ADSC)|_BV(ADPS2)|_BV(ADPS1)|_BV(ADPS0);
 
-    eeprom_read_block(initreg, eereg, sizeof(initreg));
-    isum = calculate_crc((uint8_t*)initreg, sizeof(reg));
-    if(isum==initreg[NREG]) {
-        uint8_t i;
+    eering_init(&eering, (uintptr_t)eereg, EE_NSLOT, sizeof(reg));
+    if(eering_load(&eering, initreg)) {
+        uint8_t i, err = 0;
 
-        for(i=1; i<NELEMENTS(eereg_restore_seq); i++) {
+        for(i=0; i<NELEMENTS(eereg_restore_seq); i++) {
             uint8_t reg = eereg_restore_seq[i];
-            mbus_write_holding(reg, initreg[reg]);
+            err |= mbus_write_reg(reg, initreg[reg]);
         }
+        if(err)
+            mbus_reset(); // discard exception reply
     }
 }
 
@@ -155,36 +287,93 @@ static struct pinmap pind[] = {
     {_BV(PIND6), 0x04},
 };
 
-void user_tick(void)
+// Current pin state
+// PIND4, PIND7, PINB0, PINB1, PIND5, PIND6, PINB2, PINB3
+static uint8_t read_pins(void)
 {
     uint8_t i;
-    uint8_t * const breg=(uint8_t*)reg;
     uint8_t IB = PINB, ID = PIND;
     uint8_t state = 0;
 
-    // High byte is:
-    // PIND4, PIND7, PINB0, PINB1, PIND5, PIND6, PINB2, PINB3
     for(i=0; i<NELEMENTS(pinb); i++)
         state |= (IB&pinb[i].iomask) ? pinb[i].valmask : 0;
     for(i=0; i<NELEMENTS(pind); i++)
         state |= (ID&pind[i].iomask) ? pind[i].valmask : 0;
 
-    breg[3] = state;
+    return state;
+}
+
+/* Inputs sampled by user_tick() in the Timer0 ISR,
+ * and counted by the pin change and input capture ISRs.
+ *
+ * The main loop can't interrupt an ISR, so each ISR only bumps
+ * live_seq after an update.  At the start of each register read,
+ * the main loop copies a sample into reg[] and inreg[], and retries
+ * if live_seq changed meanwhile.  So each reply is from a single
+ * sample, without disabling interrupts.  reg[] and inreg[] are only
+ * written by the main loop.
+ */
+static volatile struct {
+    uint8_t pins;
+    uint16_t adc;
+    uint32_t count[4];
+    uint32_t period[4];
+} live;
+static volatile uint8_t live_seq;
+
+/* Timer0 overflows since the last rising edge of each input,
+ * up to 255.  Beyond that server_ticks() may have wrapped.
+ */
+static uint8_t edge_age[4];
+
+void user_tick(void)
+{
+    uint8_t i;
+
+    live.pins = read_pins();
 
     if(ADCSRA&_BV(ADIF)) {
-        reg[10] = ADC;
+        live.adc = ADC;
         ADCSRA |= _BV(ADSC)|_BV(ADIF); // ack and restart
     }
+
+    for(i=0; i<4; i++) {
+        if(edge_age[i]!=255)
+            edge_age[i]++;
+    }
+
+    live_seq++;
 }
 
-void mbus_read_holding(uint16_t addr, uint8_t count, uint16_t * restrict result)
+static void ioshield_read_begin(struct mbus_ctx *ctx)
 {
-    if(addr>=sizeof(reg))
-        mbus_exception(2);
-    if(count>sizeof(reg) || addr+count>sizeof(reg))
-        mbus_exception(3);
+    uint8_t * const breg=(uint8_t*)reg;
+    uint8_t seq, pins, i;
+    uint16_t adc;
+    uint32_t count[4], period[4];
+
+    do {
+        seq = live_seq;
+        pins = live.pins;
+        adc = live.adc;
+        for(i=0; i<4; i++) {
+            count[i] = live.count[i];
+            period[i] = live.period[i];
+        }
+    } while(seq!=live_seq);
+
+    // High byte is pin state
+    breg[3] = pins;
+    reg[10] = adc;
+
+    for(i=0; i<4; i++) {
+        inreg[2*i] = count[i]>>16;
+        inreg[2*i+1] = count[i];
+        inreg[8+2*i] = period[i]>>16;
+        inreg[8+2*i+1] = period[i];
+    }
 
-    memcpy(result, reg+addr, 2*count);
+    server_latency_copy(latreg);
 }
 
 // map power of 2 to clock divider selection.  Round to lower frequency
@@ -192,9 +381,13 @@ static uint8_t divtbl[] = {0, 1, 2, 2, 2, 3, 3, 4, 5, 5};
 // map clock divider to power of 2
 static uint8_t rdivtbl[] = {0, 1, 4, 6, 8, 10};
 
-static void mbus_write_csr(uint16_t faddr, uint16_t value)
+static void mbus_write_csr(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
 {
-    value &= 0x0301; //mask out unused bits
+    if((value&0x0200) && eewrite_busy()) {
+        // previous save not done
+        mbus_ctx_exception(ctx, 6);
+        return;
+    }
 
     if(value&1) {
         // reset
@@ -212,18 +405,22 @@ static void mbus_write_csr(uint16_t faddr, uint16_t value)
     reg[0] = value&0x0100; // only write those which are safe to save
 
     if(value&0x0200) {
-        uint16_t savereg[NREG+1];
+        uint16_t savereg[NREG], addr;
+        uint8_t slot[EE_SLOT];
         /* write eeprom */
 
-        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-            memcpy(savereg, reg, sizeof(reg));
-        }
-        savereg[NREG] = calculate_crc((uint8_t*)savereg, sizeof(reg));
-        eeprom_write_block(savereg, eereg, sizeof(savereg));
+        memcpy(savereg, reg, sizeof(reg));
+        addr = eering_pack(&eering, savereg, slot);
+        eewrite_start((void*)(uintptr_t)addr, slot, sizeof(slot));
     }
 }
 
-static void mbus_write_outputs(uint16_t faddr, uint16_t rvalue)
+static uint16_t mbus_read_csr(struct mbus_ctx *ctx, uint16_t faddr)
+{
+    return reg[0] | (eewrite_busy() ? 0x0400 : 0);
+}
+
+static void mbus_write_outputs(struct mbus_ctx *ctx, uint16_t faddr, uint16_t rvalue)
 {
     uint8_t value=rvalue&0x0F;
     uint8_t *breg=(uint8_t*)reg;
@@ -248,7 +445,49 @@ if(value&MASK) {SET |= _BV(BIT);}
     breg[2] = value;
 }
 
-static void mbus_write_config_out1(uint16_t faddr, uint16_t value)
+// check bit address range for 4 coils or inputs.
+// Returns mask of selected bits, or 0 after signaling an exception
+static uint8_t bit_range(struct mbus_ctx *ctx, uint16_t addr, uint16_t count)
+{
+    if(count==0) {
+        mbus_ctx_exception(ctx, 3);
+        return 0;
+    } else if(addr>=4 || count>4-addr) {
+        mbus_ctx_exception(ctx, 2);
+        return 0;
+    }
+    return ((1<<count)-1)<<addr;
+}
+
+static void ioshield_read_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    uint8_t mask = bit_range(ctx, addr, count);
+    uint8_t *breg=(uint8_t*)reg;
+
+    if(mask)
+        result[0] = (breg[2]&mask)>>addr;
+}
+
+static void ioshield_read_discrete(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    uint8_t mask = bit_range(ctx, addr, count);
+
+    if(mask)
+        result[0] = ((read_pins()>>4)&mask)>>addr;
+}
+
+static void ioshield_write_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, const uint8_t * restrict value)
+{
+    uint8_t mask = bit_range(ctx, addr, count);
+    uint8_t *breg=(uint8_t*)reg;
+
+    if(!mask)
+        return;
+
+    mbus_write_outputs(ctx, 1, (breg[2]&~mask) | ((value[0]<<addr)&mask));
+}
+
+static void mbus_write_config_out1(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
 {
     uint8_t div=value>>8;
     uint8_t mode=value&0x3;
@@ -275,17 +514,19 @@ static void mbus_write_config_out1(uint16_t faddr, uint16_t value)
     reg[2] = value;
 }
 
-static void mbus_write_param_out1(uint16_t faddr, uint16_t value)
+static void mbus_write_param_out1(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
 {
     OCR2A = value;
+    reg[3] = value;
 }
 
-static void mbus_write_config_out2(uint16_t faddr, uint16_t value)
+static void mbus_write_config_out2(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
 {
     uint8_t div=value>>8;
     uint8_t mode=value&0x3;
 
     // disable counter in preparation to change mode
+    icp_stop();
     TCCR1A = 0;
     TCCR1B = 0;
     OCR1A = OCR1B = 0;
@@ -305,36 +546,254 @@ static void mbus_write_config_out2(uint16_t faddr, uint16_t value)
         }
         TCCR1B |= div;
         TCCR1A |= _BV(COM1B0);
+    } else {
+        // Timer1 is free to measure input 2
+        icp_start();
     }
 
     reg[4] = rdivtbl[div]<<8 | mode;
 }
 
-static void mbus_write_param_out2(uint16_t faddr, uint16_t value)
+static void mbus_write_param_out2(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
 {
     switch(reg[4]&3) {
     case 1: OCR1A = value; break;
     case 2: OCR1B = value; break;
     default: break;
     }
+    reg[5] = value;
 }
 
-typedef void (*mbus_write_op_t)(uint16_t,uint16_t);
+static void mbus_write_unit(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
+{
+    if(value<1 || value>247) {
+        mbus_ctx_exception(ctx, 3);
+        return;
+    }
+    mbus_ctx_set_unit(ctx, value);
+    reg[11] = value;
+}
 
-static mbus_write_op_t mbus_ops[] = {
-    mbus_write_csr,
-    mbus_write_outputs,
-    mbus_write_config_out1,
-    mbus_write_param_out1,
-    mbus_write_config_out2,
-    mbus_write_param_out2,
-};
+static void mbus_write_latency(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
+{
+    server_latency_reset();
+    memset(latreg, 0, sizeof(latreg));
+}
 
-void mbus_write_holding(uint16_t faddr, uint16_t value)
+/* Input edge FIFO
+ *
+ * Filled by the pin change ISRs, drained by the main loop.
+ * Each index is only written by one side, so no locking is needed.
+ */
+#define EDGE_RING 32 // power of 2
+
+static struct {
+    uint16_t time;
+    uint8_t state;
+} edge_ring[EDGE_RING];
+static volatile uint8_t edge_head; // written by ISR
+static volatile uint8_t edge_tail; // written by main loop
+static uint8_t edge_lost; // only used by ISR
+
+//! Time of the last rising edge of each input.  Only used by ISR
+static uint16_t edge_time[4];
+//! Set while Timer1 measures the period of input 2
+static volatile uint8_t icp_active;
+
+static inline void edge_capture(void)
 {
-    uint8_t addr=faddr;
-    if(faddr>=NELEMENTS(mbus_ops))
+    uint16_t now = server_ticks();
+    uint8_t state = read_pins()>>4, rising = state&~edge_prev, i;
+    uint8_t head = edge_head, next = (head+1)&(EDGE_RING-1);
+
+    edge_prev = state;
+
+    // count and time rising edges
+    for(i=0; i<4; i++) {
+        if(!(rising&(1<<i)))
+            continue;
+
+        live.count[i]++;
+
+        if(i==1 && icp_active) {
+            // period from TIMER1_CAPT_vect
+        } else if(edge_age[i]!=255 && live.count[i]>1) {
+            // ticks of 1024/F_CPU to units of 8/F_CPU
+            live.period[i] = (uint32_t)(uint16_t)(now-edge_time[i])<<7;
+        } else {
+            live.period[i] = 0;
+        }
+        edge_time[i] = now;
+        edge_age[i] = 0;
+    }
+    live_seq++;
+
+    if(next==edge_tail) {
+        edge_lost = 1;
         return;
+    }
+
+    edge_ring[head].time = now;
+    edge_ring[head].state = state | (edge_lost ? 0x80 : 0);
+    edge_lost = 0;
+    edge_head = next;
+}
+
+// Port B inputs.  In 1 and 2
+ISR(PCINT0_vect)
+{
+    edge_capture();
+}
 
-    mbus_ops[addr](faddr,value);
+// Port D inputs.  In 3 and 4
+ISR(PCINT2_vect)
+{
+    edge_capture();
 }
+
+/* Input 2 (PB0) is ICP1.  While output 2 doesn't need Timer1, it runs
+ * free at F_CPU/8 and captures rising edges of input 2.  Capture times
+ * are extended to 32 bits by counting overflows.
+ */
+static volatile uint16_t icp_ovf;
+static uint32_t icp_last;
+static uint8_t icp_have;
+
+static void icp_start(void)
+{
+    icp_have = 0;
+    TCCR1A = 0;
+    TCCR1B = _BV(ICNC1)|_BV(ICES1)|_BV(CS11); // noise canceler, rising, /8
+    TIFR1 = _BV(ICF1)|_BV(TOV1);
+    TIMSK1 = _BV(ICIE1)|_BV(TOIE1);
+    icp_active = 1;
+}
+
+static void icp_stop(void)
+{
+    TIMSK1 = 0;
+    icp_active = 0;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+    icp_ovf++;
+}
+
+ISR(TIMER1_CAPT_vect)
+{
+    uint16_t lo = ICR1, hi = icp_ovf;
+    uint32_t now;
+
+    // overflow not yet handled
+    if((TIFR1&_BV(TOV1)) && lo<0x8000)
+        hi++;
+    now = (uint32_t)hi<<16 | lo;
+
+    if(icp_have) {
+        live.period[1] = now-icp_last;
+        live_seq++;
+    }
+    icp_last = now;
+    icp_have = 1;
+}
+
+static uint8_t ioshield_read_fifo(struct mbus_ctx *ctx, uint16_t addr, uint8_t max, uint16_t * restrict result)
+{
+    uint8_t tail = edge_tail, n = 0;
+
+    if(addr!=0) {
+        mbus_ctx_exception(ctx, 2);
+        return 0;
+    }
+
+    while(n+2<=max && tail!=edge_head) {
+        result[n++] = edge_ring[tail].time;
+        result[n++] = edge_ring[tail].state;
+        tail = (tail+1)&(EDGE_RING-1);
+    }
+
+    edge_tail = tail;
+    return n;
+}
+
+static void mbus_write_count(struct mbus_ctx *ctx, uint16_t faddr, uint16_t value)
+{
+    uint8_t i = (faddr-IN_BASE)/2;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        live.count[i] = 0;
+    }
+    inreg[2*i] = inreg[2*i+1] = 0;
+}
+
+static uint16_t mbus_read_freq(struct mbus_ctx *ctx, uint16_t faddr)
+{
+    uint8_t i = (faddr-IN_FREQ)/2;
+    uint32_t period = (uint32_t)inreg[8+2*i]<<16 | inreg[8+2*i+1], freq;
+
+    freq = period ? (F_CPU/8ul*100ul)/period : 0;
+
+    return (faddr-IN_FREQ)&1 ? (uint16_t)freq : (uint16_t)(freq>>16);
+}
+
+static uint16_t mbus_read_instat(struct mbus_ctx *ctx, uint16_t faddr)
+{
+    return icp_active ? 0x0002 : 0;
+}
+
+#define RW MBUS_REG_RW
+#define RO MBUS_REG_R
+#define LAT(N) [LAT_BASE+(N)] = {&latreg[N], NULL, NULL, 0, RO}
+#define CNT(N) [IN_BASE+(N)] = {&inreg[N], NULL, mbus_write_count, 0xFFFF, RW}
+#define PER(N) [IN_BASE+8+(N)] = {&inreg[8+(N)], NULL, NULL, 0, RO}
+#define FREQ(N) [IN_FREQ+(N)] = {NULL, mbus_read_freq, NULL, 0, RO}
+
+static const struct mbus_reg regmap[NMAP] MBUS_REGMAP = {
+    [0]  = {&reg[0],  mbus_read_csr, mbus_write_csr, 0x0301, RW},
+    [1]  = {&reg[1],  NULL, mbus_write_outputs,     0x000F, RW},
+    [2]  = {&reg[2],  NULL, mbus_write_config_out1, 0xFF03, RW},
+    [3]  = {&reg[3],  NULL, mbus_write_param_out1,  0xFFFF, RW},
+    [4]  = {&reg[4],  NULL, mbus_write_config_out2, 0xFF03, RW},
+    [5]  = {&reg[5],  NULL, mbus_write_param_out2,  0xFFFF, RW},
+    // outputs 3 and 4 are not configurable yet
+    [6]  = {&reg[6],  NULL, NULL, 0, RO},
+    [7]  = {&reg[7],  NULL, NULL, 0, RO},
+    [8]  = {&reg[8],  NULL, NULL, 0, RO},
+    [9]  = {&reg[9],  NULL, NULL, 0, RO},
+    [10] = {&reg[10], NULL, NULL, 0, RO},
+    [11] = {&reg[11], NULL, mbus_write_unit,        0xFFFF, RW},
+    LAT(SERVER_LAT_LAST),
+    [LAT_BASE+SERVER_LAT_MAX] = {&latreg[SERVER_LAT_MAX], NULL, mbus_write_latency, 0, RW},
+    LAT(SERVER_LAT_HIST+0),  LAT(SERVER_LAT_HIST+1),  LAT(SERVER_LAT_HIST+2),
+    LAT(SERVER_LAT_HIST+3),  LAT(SERVER_LAT_HIST+4),  LAT(SERVER_LAT_HIST+5),
+    LAT(SERVER_LAT_HIST+6),  LAT(SERVER_LAT_HIST+7),  LAT(SERVER_LAT_HIST+8),
+    LAT(SERVER_LAT_HIST+9),  LAT(SERVER_LAT_HIST+10), LAT(SERVER_LAT_HIST+11),
+    LAT(SERVER_LAT_HIST+12), LAT(SERVER_LAT_HIST+13), LAT(SERVER_LAT_HIST+14),
+    LAT(SERVER_LAT_HIST+15),
+    // 0x001E-0x001F unused
+    CNT(0),  CNT(1),  CNT(2),  CNT(3),  CNT(4),  CNT(5),  CNT(6),  CNT(7),
+    PER(0),  PER(1),  PER(2),  PER(3),  PER(4),  PER(5),  PER(6),  PER(7),
+    FREQ(0), FREQ(1), FREQ(2), FREQ(3), FREQ(4), FREQ(5), FREQ(6), FREQ(7),
+    [IN_STATUS] = {NULL, mbus_read_instat, NULL, 0, RO},
+};
+
+#if SERVER_LAT_NBUCKET!=16
+#  error Update latency histogram entries of regmap
+#endif
+
+#undef RW
+#undef RO
+#undef LAT
+#undef CNT
+#undef PER
+#undef FREQ
+
+/* Replaces the global hooks.  Holding registers are served by regmap. */
+static const struct mbus_ops ioshield_ops = {
+    .read_coils = ioshield_read_coils,
+    .read_discrete = ioshield_read_discrete,
+    .write_coils = ioshield_write_coils,
+    .read_fifo = ioshield_read_fifo,
+    .read_begin = ioshield_read_begin,
+};
@@ -0,0 +1,259 @@
+/** Modbus register cache daemon
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Polls register ranges of Modbus RTU servers and publishes
+ * them in a memory mapped file (see mbcache.h) for any number
+ * of local readers.
+ *
+ *  $ ./mbcache-HOST.elf -f /dev/shm/mbcache /dev/ttyUSB0 1:0:12 2:0:12
+ *  $ ./mbcache-HOST.elf -f /dev/shm/mbcache -d
+ *
+ * Ranges are unit:addr:count with count<=125.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "mbcache.h"
+#include "rtu.h"
+
+static volatile int stop;
+
+static void handler(int num)
+{
+    stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void block_begin(struct mbcache_block *blk)
+{
+    __atomic_store_n(&blk->seq, blk->seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void block_end(struct mbcache_block *blk)
+{
+    __atomic_store_n(&blk->seq, blk->seq+1, __ATOMIC_RELEASE);
+}
+
+// read one block from the bus and publish
+static void poll_block(int fd, unsigned baud, unsigned timeout, struct mbcache_block *blk)
+{
+    uint8_t req[8], rep[RTU_MAX_FRAME];
+    uint16_t count = blk->value.count;
+    int ret;
+
+    req[0] = blk->unit;
+    req[1] = 3;
+    req[2] = blk->addr>>8;
+    req[3] = blk->addr;
+    req[4] = count>>8;
+    req[5] = count;
+    rtu_add_crc(req, 6);
+
+    ret = rtu_transact(fd, baud, req, sizeof(req), rep, sizeof(rep), timeout);
+
+    block_begin(blk);
+    if(ret<0) {
+        blk->value.nfail++;
+        blk->value.error = 0x100+errno;
+    } else if(rep[1]&0x80) {
+        blk->value.nfail++;
+        blk->value.error = rep[2];
+    } else if(ret!=5+2*count || rep[2]!=2*count) {
+        blk->value.nfail++;
+        blk->value.error = 0x100+EBADMSG;
+    } else {
+        unsigned i;
+        for(i=0; i<count; i++)
+            blk->value.regs[i] = rep[3+2*i]<<8 | rep[4+2*i];
+        blk->value.stamp = now_ns();
+        blk->value.nfail = 0;
+        blk->value.error = 0;
+    }
+    block_end(blk);
+}
+
+static int dump(const char *path)
+{
+    const struct mbcache_header *hdr = mbcache_map(path);
+    uint64_t now = now_ns();
+    unsigned i, j;
+
+    if(!hdr) {
+        fprintf(stderr, "Can't map %s\n", path);
+        return 1;
+    }
+
+    for(i=0; i<hdr->nblocks; i++) {
+        struct mbcache_value val;
+        const struct mbcache_block *blk = mbcache_block(hdr, i);
+
+        mbcache_snapshot(blk, &val);
+
+        printf("%u:%u:%u", blk->unit, blk->addr, val.count);
+        if(val.stamp)
+            printf(" age %.3f s", (now-val.stamp)*1e-9);
+        else
+            printf(" never");
+        if(val.error)
+            printf(" error 0x%x x%u", val.error, val.nfail);
+        printf("\n");
+
+        for(j=0; val.stamp && j<val.count; j++)
+            printf("%s%04x", (j%8)==0 ? (j ? "\n " : " ") : " ", val.regs[j]);
+        if(val.stamp)
+            printf("\n");
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-f file] [-b baud] [-i ms] [-t ms] <tty> <unit:addr:count> ...\n"
+            "       %s [-f file] -d\n"
+            "  -f file  Cache file (default /dev/shm/mbcache)\n"
+            "  -b baud  Serial baud rate (default 115200)\n"
+            "  -i ms    Scan interval (default 1000)\n"
+            "  -t ms    Reply timeout (default 500)\n"
+            "  -d       Print cache file contents\n",
+            name, name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/shm/mbcache";
+    unsigned baud = 115200, interval = 1000, timeout = 500;
+    unsigned nblocks, i;
+    struct mbcache_header *hdr;
+    struct sigaction act;
+    size_t size;
+    char *tmp;
+    int opt, dodump = 0, fd, line;
+
+    while((opt=getopt(argc, argv, "f:b:i:t:dh"))!=-1) {
+        switch(opt) {
+        case 'f': path = optarg; break;
+        case 'b': baud = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'd': dodump = 1; break;
+        default:
+            usage(argv[0]);
+            return opt!='h';
+        }
+    }
+
+    if(dodump)
+        return dump(path);
+
+    if(argc-optind<2) {
+        usage(argv[0]);
+        return 1;
+    }
+    nblocks = argc-optind-1;
+
+    // build new file, then rename into place, so readers
+    // never see a partial header.
+    if(asprintf(&tmp, "%s.tmp", path)<0)
+        return 1;
+    size = sizeof(*hdr) + nblocks*sizeof(struct mbcache_block);
+
+    fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd<0 || ftruncate(fd, size)) {
+        perror(tmp);
+        return 1;
+    }
+    hdr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hdr==MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    hdr->magic = MBCACHE_MAGIC;
+    hdr->block_size = sizeof(struct mbcache_block);
+    hdr->nblocks = nblocks;
+
+    for(i=0; i<nblocks; i++) {
+        struct mbcache_block *blk = (struct mbcache_block*)mbcache_block(hdr, i);
+        unsigned unit, addr, count;
+
+        if(sscanf(argv[optind+1+i], "%u:%u:%u", &unit, &addr, &count)!=3
+                || unit<1 || unit>247 || addr>0xffff
+                || count<1 || count>MBCACHE_MAX_REGS || addr+count>0x10000) {
+            fprintf(stderr, "Invalid range '%s'\n", argv[optind+1+i]);
+            unlink(tmp);
+            return 1;
+        }
+        blk->unit = unit;
+        blk->addr = addr;
+        blk->value.count = count;
+    }
+
+    line = rtu_open(argv[optind], baud);
+    if(line<0) {
+        perror(argv[optind]);
+        unlink(tmp);
+        return 1;
+    }
+
+    if(rename(tmp, path)) {
+        perror(path);
+        unlink(tmp);
+        return 1;
+    }
+    free(tmp);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    while(!stop) {
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += interval/1000;
+        next.tv_nsec += (interval%1000)*1000000;
+        if(next.tv_nsec>=1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+
+        for(i=0; i<nblocks && !stop; i++)
+            poll_block(line, baud, timeout, (struct mbcache_block*)mbcache_block(hdr, i));
+
+        while(!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)==EINTR) {}
+    }
+
+    close(line);
+    munmap(hdr, size);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/** Shared memory Modbus register cache
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef MBCACHE_H
+#define MBCACHE_H
+
+#include <inttypes.h>
+#include <string.h>
+
+/* Layout of the file written by mbcache, and lock-free readers.
+ *
+ * The file is a header followed by nblocks blocks.  Each block
+ * is one register range of one unit, which the daemon reads
+ * with function 3 and updates in place under a sequence lock.
+ *
+ * Readers map the file (read-only), then use mbcache_find()
+ * and mbcache_snapshot().  Neither makes any system call,
+ * or causes any bus traffic.
+ *
+ *  const struct mbcache_header *C = mbcache_map("/dev/shm/mbcache");
+ *  const struct mbcache_block *B = mbcache_find(C, 1, 0);
+ *  struct mbcache_value V;
+ *  mbcache_snapshot(B, &V);
+ */
+
+#define MBCACHE_MAGIC 0x4d424332 // "MBC2"
+#define MBCACHE_MAX_REGS 125
+
+/* Blocks are aligned to a (64 byte) cache line, so one block's seq
+ * and data never share a line with its neighbour.  The header is
+ * padded to a whole line, so the first block follows it directly.
+ * The file is mapped at a page boundary.
+ */
+struct mbcache_header {
+    uint32_t magic;
+    //! sizeof(struct mbcache_block)
+    uint32_t block_size;
+    uint32_t nblocks;
+} __attribute__((aligned(64)));
+
+//! Consistent copy of a block
+struct mbcache_value {
+    //! time of last successful read. ns since 1970 (CLOCK_REALTIME)
+    uint64_t stamp;
+    //! Reads which failed since the last success
+    uint32_t nfail;
+    //! 0 or last error.  Modbus exception code, or 0x100+errno
+    uint16_t error;
+    uint16_t count;
+    uint16_t regs[MBCACHE_MAX_REGS];
+};
+
+struct mbcache_block {
+    //! Odd while being updated
+    uint32_t seq;
+    uint8_t unit;
+    uint8_t pad;
+    uint16_t addr;
+    struct mbcache_value value;
+} __attribute__((aligned(64)));
+
+static inline
+const struct mbcache_block *mbcache_block(const struct mbcache_header *hdr, unsigned i)
+{
+    return (const struct mbcache_block*)((const char*)(hdr+1) + i*hdr->block_size);
+}
+
+//! Find the block for a unit containing register addr.  NULL if none
+static inline
+const struct mbcache_block *mbcache_find(const struct mbcache_header *hdr,
+                                         uint8_t unit, uint16_t addr)
+{
+    unsigned i;
+    for(i=0; i<hdr->nblocks; i++) {
+        const struct mbcache_block *blk = mbcache_block(hdr, i);
+        if(blk->unit==unit && addr>=blk->addr && addr-blk->addr<blk->value.count)
+            return blk;
+    }
+    return NULL;
+}
+
+/** @brief Copy a block
+ *
+ * Retries until a copy is made which isn't overlapped by an update.
+ * Returns the number of retries.
+ */
+static inline
+unsigned mbcache_snapshot(const struct mbcache_block *blk, struct mbcache_value *val)
+{
+    unsigned retry = 0;
+    uint32_t s1, s2;
+
+    while(1) {
+        s1 = __atomic_load_n(&blk->seq, __ATOMIC_ACQUIRE);
+        if(!(s1&1)) {
+            memcpy(val, (const void*)&blk->value, sizeof(*val));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            s2 = __atomic_load_n(&blk->seq, __ATOMIC_RELAXED);
+            if(s1==s2)
+                return retry;
+        }
+        retry++;
+    }
+}
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//! Map cache file read-only.  NULL on error
+static inline
+const struct mbcache_header *mbcache_map(const char *path)
+{
+    const struct mbcache_header *hdr;
+    struct stat st;
+    void *ptr;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if(fd<0)
+        return NULL;
+    if(fstat(fd, &st) || st.st_size<(off_t)sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr==MAP_FAILED)
+        return NULL;
+
+    hdr = ptr;
+    if(hdr->magic!=MBCACHE_MAGIC || hdr->block_size!=sizeof(struct mbcache_block)
+            || st.st_size<(off_t)(sizeof(*hdr)+hdr->nblocks*hdr->block_size)) {
+        munmap(ptr, st.st_size);
+        return NULL;
+    }
+    return hdr;
+}
+
+#endif // MBCACHE_H
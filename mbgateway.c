@@ -0,0 +1,705 @@
+/** Modbus TCP to RTU gateway
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Accepts Modbus TCP (MBAP) clients and forwards their requests,
+ * one at a time, to the servers on a single RTU line.
+ *
+ *  $ ./mbgateway-HOST.elf [-p port] [-b baud] /dev/ttyUSB0
+ *
+ * Each client may have a few requests queued (CLIENT_PENDING).
+ * Further requests are not read from its socket until one completes.
+ * The line is given to clients in round robin order.
+ * When the total queue (-q) is full, requests are rejected
+ * with exception 6 (server busy).  Requests which get no valid
+ * reply are answered with exception 0x0B (target failed to respond).
+ *
+ * Requests for unit 0 (broadcast) are sent, but not answered.
+ *
+ * To test without hardware, point at the pty of mbsim.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mbus.h"
+#include "rtu.h"
+
+#define MAX_CLIENTS 64
+//! Requests queued from one client
+#define CLIENT_PENDING 4
+//! MBAP header
+#define MBAP_HEAD 7
+//! MBAP header and largest PDU
+#define MBAP_MAX (MBAP_HEAD+253)
+
+// epoll event IDs.  Clients are ID_CLIENT+slot
+#define ID_LISTEN 0
+#define ID_LINE 1
+#define ID_TIMER 2
+#define ID_CLIENT 16
+
+struct client;
+
+struct request {
+    struct request *next;
+    //! NULL if client disconnected while request was active
+    struct client *client;
+    uint16_t tid;
+    size_t len;
+    union {
+        uint8_t b[RTU_MAX_FRAME];
+        struct mbus_message m;
+    } frame;
+};
+
+struct client {
+    int fd;
+    unsigned slot;
+    uint32_t events;
+
+    uint8_t rx[2*MBAP_MAX];
+    size_t rxlen;
+
+    uint8_t tx[8*MBAP_MAX];
+    size_t txlen;
+
+    //! queued requests
+    struct request *head, *tail;
+    unsigned npending;
+};
+
+enum line_state {
+    //! ready to send the next request
+    LINE_IDLE,
+    //! waiting for inter-frame gap, or broadcast turnaround
+    LINE_GAP,
+    //! sending request
+    LINE_SEND,
+    //! waiting for reply
+    LINE_REPLY,
+};
+
+static struct {
+    int efd, lfd, line, tfd;
+    unsigned baud, gap_us;
+    unsigned timeout_ms, bcast_ms;
+    unsigned queue_max, nqueued;
+    int verbose;
+
+    struct client *clients[MAX_CLIENTS];
+    //! round robin position
+    unsigned rr_next;
+
+    enum line_state state;
+    struct request *active;
+    size_t txpos;
+    uint8_t rx[RTU_MAX_FRAME];
+    size_t rxlen;
+
+    unsigned long ntrans, ntimeout, nbusy, nbad;
+} G;
+
+static volatile int stop;
+
+static void handler(int num)
+{
+    stop = 1;
+}
+
+static void line_start(void);
+
+static int epoll_set(int op, int fd, uint32_t events, uint64_t id)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = id;
+    return epoll_ctl(G.efd, op, fd, &ev);
+}
+
+static void timer_set(unsigned us)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = us/1000000;
+    its.it_value.tv_nsec = (us%1000000)*1000;
+    if(!us)
+        its.it_value.tv_nsec = 1; // expire now
+    timerfd_settime(G.tfd, 0, &its, NULL);
+}
+
+/* Client connections */
+
+static void client_update(struct client *c)
+{
+    uint32_t events = 0;
+    if(c->npending<CLIENT_PENDING)
+        events |= EPOLLIN;
+    if(c->txlen)
+        events |= EPOLLOUT;
+    if(events!=c->events) {
+        c->events = events;
+        epoll_set(EPOLL_CTL_MOD, c->fd, events, ID_CLIENT+c->slot);
+    }
+}
+
+static void client_close(struct client *c)
+{
+    struct request *req;
+
+    if(G.verbose)
+        fprintf(stderr, "client %u disconnect\n", c->slot);
+
+    epoll_ctl(G.efd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    while((req=c->head)!=NULL) {
+        c->head = req->next;
+        free(req);
+        G.nqueued--;
+    }
+    if(G.active && G.active->client==c)
+        G.active->client = NULL;
+
+    G.clients[c->slot] = NULL;
+    free(c);
+}
+
+//! Queue data to be sent.  Returns non-zero if the client was closed.
+static int client_send(struct client *c, const uint8_t *buf, size_t n)
+{
+    if(!c->txlen) {
+        ssize_t ret = send(c->fd, buf, n, MSG_NOSIGNAL);
+        if(ret<0 && errno!=EAGAIN && errno!=EINTR) {
+            client_close(c);
+            return 1;
+        } else if(ret>0) {
+            buf += ret;
+            n -= ret;
+        }
+    }
+    if(n>sizeof(c->tx)-c->txlen) {
+        // client isn't reading replies
+        client_close(c);
+        return 1;
+    }
+    memcpy(c->tx+c->txlen, buf, n);
+    c->txlen += n;
+    client_update(c);
+    return 0;
+}
+
+//! Send reply PDU
+static int client_reply(struct client *c, uint16_t tid, uint8_t unit,
+                         const uint8_t *pdu, size_t n)
+{
+    uint8_t msg[MBAP_MAX];
+
+    msg[0] = tid>>8;
+    msg[1] = tid;
+    msg[2] = msg[3] = 0; // protocol
+    msg[4] = (n+1)>>8;
+    msg[5] = n+1;
+    msg[6] = unit;
+    memcpy(msg+MBAP_HEAD, pdu, n);
+    return client_send(c, msg, MBAP_HEAD+n);
+}
+
+static int client_exception(struct client *c, uint16_t tid, uint8_t unit,
+                            uint8_t function, uint8_t code)
+{
+    uint8_t pdu[2] = {function|0x80, code};
+    return client_reply(c, tid, unit, pdu, 2);
+}
+
+//! Parse and queue requests.  Returns non-zero if the client was closed.
+static int client_parse(struct client *c)
+{
+    size_t pos = 0;
+    int ret = 0;
+
+    while(c->npending<CLIENT_PENDING && c->rxlen-pos>=MBAP_HEAD) {
+        const uint8_t *msg = c->rx+pos;
+        uint16_t tid = msg[0]<<8 | msg[1],
+                 proto = msg[2]<<8 | msg[3],
+                 len = msg[4]<<8 | msg[5];
+        size_t pdulen = len-1;
+        struct request *req;
+        int flen;
+
+        if(proto!=0 || len<2 || len>254) {
+            client_close(c);
+            return 1;
+        } else if(c->rxlen-pos<(size_t)MBAP_HEAD-1+len)
+            break; // incomplete
+        pos += MBAP_HEAD-1+len;
+
+        if(G.nqueued>=G.queue_max) {
+            G.nbusy++;
+            if((ret=client_exception(c, tid, msg[6], msg[7], 6)))
+                return ret;
+            continue;
+        }
+
+        req = calloc(1, sizeof(*req));
+        if(!req) {
+            if((ret=client_exception(c, tid, msg[6], msg[7], 6)))
+                return ret;
+            continue;
+        }
+        req->client = c;
+        req->tid = tid;
+        memcpy(req->frame.b, msg+MBAP_HEAD-1, 1+pdulen);
+
+        // expected length includes CRC
+        flen = rtu_request_len(req->frame.b, 1+pdulen);
+        if(flen!=(int)(3+pdulen)) {
+            // unknown function, or wrong length
+            uint8_t code = flen<0 ? 1 : 3;
+            free(req);
+            if((ret=client_exception(c, tid, msg[6], msg[7], code)))
+                return ret;
+            continue;
+        }
+        req->len = rtu_add_crc(req->frame.b, 1+pdulen);
+
+        if(c->tail)
+            c->tail->next = req;
+        else
+            c->head = req;
+        c->tail = req;
+        c->npending++;
+        G.nqueued++;
+    }
+
+    memmove(c->rx, c->rx+pos, c->rxlen-pos);
+    c->rxlen -= pos;
+    client_update(c);
+
+    line_start();
+    return 0;
+}
+
+static void client_read(struct client *c)
+{
+    ssize_t ret = recv(c->fd, c->rx+c->rxlen, sizeof(c->rx)-c->rxlen, 0);
+    if(ret<0 && (errno==EAGAIN || errno==EINTR))
+        return;
+    else if(ret<=0) {
+        client_close(c);
+        return;
+    }
+    c->rxlen += ret;
+    client_parse(c);
+}
+
+static void client_write(struct client *c)
+{
+    ssize_t ret = send(c->fd, c->tx, c->txlen, MSG_NOSIGNAL);
+    if(ret<0 && (errno==EAGAIN || errno==EINTR))
+        return;
+    else if(ret<0) {
+        client_close(c);
+        return;
+    }
+    memmove(c->tx, c->tx+ret, c->txlen-ret);
+    c->txlen -= ret;
+    client_update(c);
+}
+
+static void client_accept(void)
+{
+    struct client *c;
+    unsigned slot;
+    int fd, one = 1;
+
+    fd = accept4(G.lfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(fd<0)
+        return;
+
+    for(slot=0; slot<MAX_CLIENTS && G.clients[slot]; slot++) {}
+
+    if(slot==MAX_CLIENTS || !(c=calloc(1, sizeof(*c)))) {
+        close(fd);
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->fd = fd;
+    c->slot = slot;
+    c->events = EPOLLIN;
+    if(epoll_set(EPOLL_CTL_ADD, fd, c->events, ID_CLIENT+slot)) {
+        close(fd);
+        free(c);
+        return;
+    }
+    G.clients[slot] = c;
+
+    if(G.verbose)
+        fprintf(stderr, "client %u connect\n", slot);
+}
+
+/* RTU line */
+
+//! Finish active request, and wait for inter-frame gap
+static void line_done(void)
+{
+    free(G.active);
+    G.active = NULL;
+    G.rxlen = 0;
+    G.state = LINE_GAP;
+    timer_set(G.gap_us);
+}
+
+static void line_fail(void)
+{
+    struct request *req = G.active;
+    struct client *c = req->client;
+
+    if(c)
+        client_exception(c, req->tid, req->frame.m.node, req->frame.m.function, 0x0B);
+    line_done();
+}
+
+static void line_reply(void)
+{
+    struct request *req = G.active;
+    struct client *c = req->client;
+    const struct mbus_message *rep = (const struct mbus_message*)G.rx;
+
+    if(rep->node!=req->frame.m.node || (rep->function&0x7f)!=req->frame.m.function
+            || rtu_check(G.rx, G.rxlen)) {
+        G.nbad++;
+        if(G.verbose)
+            fprintf(stderr, "unit %u invalid reply\n", req->frame.m.node);
+        line_fail();
+        return;
+    }
+
+    G.ntrans++;
+    if(c) {
+        if(G.rxlen==4) {
+            // exception with LRC
+            client_exception(c, req->tid, rep->node, rep->function, rep->mb_e.code);
+        } else {
+            // PDU is between unit and CRC
+            client_reply(c, req->tid, rep->node, G.rx+1, G.rxlen-3);
+        }
+    }
+    line_done();
+}
+
+//! Send the next request, if the line is idle
+static void line_start(void)
+{
+    struct request *req = NULL;
+    struct client *c = NULL;
+    unsigned i;
+
+    if(G.state!=LINE_IDLE)
+        return;
+
+    for(i=0; i<MAX_CLIENTS; i++) {
+        unsigned slot = (G.rr_next+i)%MAX_CLIENTS;
+        c = G.clients[slot];
+        if(c && c->head) {
+            G.rr_next = slot+1;
+            break;
+        }
+    }
+    if(i==MAX_CLIENTS)
+        return;
+
+    req = c->head;
+    c->head = req->next;
+    if(!c->head)
+        c->tail = NULL;
+    c->npending--;
+    G.nqueued--;
+    req->next = NULL;
+
+    G.active = req;
+    G.txpos = 0;
+    G.rxlen = 0;
+    G.state = LINE_SEND;
+
+    // more requests may be waiting in the client buffer
+    client_parse(c);
+}
+
+static void line_write(void)
+{
+    struct request *req = G.active;
+
+    while(G.txpos<req->len) {
+        ssize_t ret = write(G.line, req->frame.b+G.txpos, req->len-G.txpos);
+        if(ret<0 && errno==EINTR)
+            continue;
+        else if(ret<0 && errno==EAGAIN) {
+            epoll_set(EPOLL_CTL_MOD, G.line, EPOLLIN|EPOLLOUT, ID_LINE);
+            return;
+        } else if(ret<0) {
+            perror("write");
+            stop = 1;
+            return;
+        }
+        G.txpos += ret;
+    }
+    epoll_set(EPOLL_CTL_MOD, G.line, EPOLLIN, ID_LINE);
+
+    if(req->frame.m.node==0) {
+        // broadcast, no reply.  Wait for servers to act.
+        free(G.active);
+        G.active = NULL;
+        G.state = LINE_GAP;
+        timer_set(1000*G.bcast_ms);
+    } else {
+        // timeout from end of transmission
+        G.state = LINE_REPLY;
+        timer_set(1000*G.timeout_ms + req->len*11000000ull/G.baud);
+    }
+}
+
+static void line_read(void)
+{
+    uint8_t buf[RTU_MAX_FRAME];
+    ssize_t n = read(G.line, buf, sizeof(buf));
+
+    if(n<0 && (errno==EAGAIN || errno==EINTR))
+        return;
+    else if(n<=0) {
+        perror("read");
+        stop = 1;
+        return;
+    }
+
+    if(G.state!=LINE_REPLY) {
+        // unexpected.  discard and restart gap
+        if(G.state==LINE_GAP)
+            timer_set(G.gap_us);
+        return;
+    }
+
+    if((size_t)n>sizeof(G.rx)-G.rxlen)
+        n = sizeof(G.rx)-G.rxlen;
+    memcpy(G.rx+G.rxlen, buf, n);
+    G.rxlen += n;
+
+    {
+        int len = rtu_reply_len(G.rx, G.rxlen);
+        if(len<0 || len>RTU_MAX_FRAME || (len>0 && (size_t)len<G.rxlen)) {
+            G.nbad++;
+            line_fail();
+        } else if(len>0 && (size_t)len==G.rxlen) {
+            line_reply();
+        }
+    }
+}
+
+static void line_timer(void)
+{
+    uint64_t cnt;
+    if(read(G.tfd, &cnt, sizeof(cnt))!=sizeof(cnt))
+        return;
+
+    switch(G.state) {
+    case LINE_REPLY:
+        G.ntimeout++;
+        if(G.verbose)
+            fprintf(stderr, "unit %u timeout\n", G.active->frame.m.node);
+        line_fail();
+        break;
+    case LINE_GAP:
+        G.state = LINE_IDLE;
+        line_start();
+        break;
+    default:
+        break;
+    }
+}
+
+static int listen_on(const char *addr, unsigned port)
+{
+    struct sockaddr_in sa;
+    int fd, one = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if(inet_pton(AF_INET, addr, &sa.sin_addr)!=1) {
+        fprintf(stderr, "Invalid address '%s'\n", addr);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(fd<0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-a addr] [-p port] [-b baud] [-t ms] [-B ms] [-q count] [-v] <tty>\n"
+            "  -a addr   Listen address (default 0.0.0.0)\n"
+            "  -p port   TCP port (default 502)\n"
+            "  -b baud   Serial baud rate (default 115200)\n"
+            "  -t ms     Reply timeout (default 1000)\n"
+            "  -B ms     Delay after broadcast (default 100)\n"
+            "  -q count  Max. queued requests (default 32)\n"
+            "  -v        Verbose\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *addr = "0.0.0.0";
+    unsigned port = 502, i;
+    struct sigaction act;
+    int opt;
+
+    G.baud = 115200;
+    G.timeout_ms = 1000;
+    G.bcast_ms = 100;
+    G.queue_max = 32;
+
+    while((opt=getopt(argc, argv, "a:p:b:t:B:q:vh"))!=-1) {
+        switch(opt) {
+        case 'a': addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'b': G.baud = atoi(optarg); break;
+        case 't': G.timeout_ms = atoi(optarg); break;
+        case 'B': G.bcast_ms = atoi(optarg); break;
+        case 'q': G.queue_max = atoi(optarg); break;
+        case 'v': G.verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return opt!='h';
+        }
+    }
+    if(optind+1!=argc || G.queue_max==0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    G.gap_us = rtu_gap_us(G.baud);
+
+    G.line = rtu_open(argv[optind], G.baud);
+    if(G.line<0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    G.lfd = listen_on(addr, port);
+    if(G.lfd<0) {
+        perror("listen");
+        return 1;
+    }
+
+    G.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    G.efd = epoll_create1(EPOLL_CLOEXEC);
+    if(G.tfd<0 || G.efd<0) {
+        perror("epoll");
+        return 1;
+    }
+
+    if(epoll_set(EPOLL_CTL_ADD, G.lfd, EPOLLIN, ID_LISTEN)
+            || epoll_set(EPOLL_CTL_ADD, G.line, EPOLLIN, ID_LINE)
+            || epoll_set(EPOLL_CTL_ADD, G.tfd, EPOLLIN, ID_TIMER)) {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    // start with a gap to let the line settle
+    G.state = LINE_GAP;
+    timer_set(G.gap_us);
+
+    while(!stop) {
+        struct epoll_event evs[16];
+        int n = epoll_wait(G.efd, evs, 16, -1), j;
+
+        if(n<0 && errno==EINTR)
+            continue;
+        else if(n<0) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for(j=0; j<n; j++) {
+            uint64_t id = evs[j].data.u64;
+
+            if(id==ID_LISTEN) {
+                client_accept();
+
+            } else if(id==ID_LINE) {
+                if(evs[j].events&EPOLLOUT && G.state==LINE_SEND)
+                    line_write();
+                if(evs[j].events&(EPOLLIN|EPOLLERR|EPOLLHUP))
+                    line_read();
+
+            } else if(id==ID_TIMER) {
+                line_timer();
+
+            } else {
+                struct client *c = G.clients[id-ID_CLIENT];
+                // may have been closed by an earlier event
+                if(c && evs[j].events&EPOLLOUT)
+                    client_write(c);
+                c = G.clients[id-ID_CLIENT];
+                if(c && evs[j].events&(EPOLLIN|EPOLLERR|EPOLLHUP))
+                    client_read(c);
+            }
+
+            // a request queued by a client is sent as soon as the line is idle
+            if(G.state==LINE_SEND && G.txpos==0)
+                line_write();
+        }
+    }
+
+    fprintf(stderr, "%lu transactions, %lu timeouts, %lu invalid, %lu busy\n",
+            G.ntrans, G.ntimeout, G.nbad, G.nbusy);
+
+    for(i=0; i<MAX_CLIENTS; i++) {
+        if(G.clients[i])
+            client_close(G.clients[i]);
+    }
+    close(G.efd);
+    close(G.tfd);
+    close(G.lfd);
+    close(G.line);
+    return 0;
+}
@@ -0,0 +1,409 @@
+/** Modbus RTU master with poll scheduler
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "rtu.h"
+#include "mbmaster.h"
+
+//! Wait after broadcast for servers to act
+#define BCAST_DELAY_US 100000
+
+struct mbmaster_poll {
+    uint8_t frame[RTU_MAX_FRAME];
+    size_t len;
+    mbmaster_cb cb;
+    void *arg;
+
+    //! for one-shot requests
+    struct mbmaster_poll *next;
+
+    uint64_t period, due;
+};
+
+enum mbmaster_state {
+    MASTER_IDLE,
+    //! waiting for end of gap
+    MASTER_GAP,
+    //! waiting for reply
+    MASTER_REPLY,
+};
+
+struct mbmaster {
+    int fd, tfd;
+    unsigned baud, gap_us, timeout_us;
+
+    enum mbmaster_state state;
+    //! end of gap, or reply deadline
+    uint64_t until;
+    uint64_t sent;
+    struct mbmaster_poll *active;
+    int active_once;
+
+    uint8_t rx[RTU_MAX_FRAME];
+    size_t rxlen;
+
+    struct mbmaster_poll *once_head, *once_tail;
+
+    struct mbmaster_poll **polls;
+    size_t npolls;
+
+    struct mbmaster_stats stats[248];
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
+}
+
+// wake at absolute time.  0 to disarm
+static void timer_at(struct mbmaster *m, uint64_t when)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(when) {
+        its.it_value.tv_sec = when/1000000;
+        its.it_value.tv_nsec = (when%1000000)*1000;
+    }
+    timerfd_settime(m->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+struct mbmaster *mbmaster_create(const char *port, unsigned baud)
+{
+    struct mbmaster *m = calloc(1, sizeof(*m));
+    if(!m)
+        return NULL;
+
+    m->baud = baud;
+    m->gap_us = rtu_gap_us(baud);
+    m->timeout_us = 1000000;
+
+    m->fd = rtu_open(port, baud);
+    m->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if(m->fd<0 || m->tfd<0) {
+        mbmaster_destroy(m);
+        return NULL;
+    }
+
+    // start with a gap to let the line settle
+    m->state = MASTER_GAP;
+    m->until = now_us()+m->gap_us;
+    timer_at(m, m->until);
+    return m;
+}
+
+void mbmaster_destroy(struct mbmaster *m)
+{
+    struct mbmaster_poll *p;
+    size_t i;
+
+    if(!m)
+        return;
+    if(m->fd>=0)
+        close(m->fd);
+    if(m->tfd>=0)
+        close(m->tfd);
+    if(m->active && m->active_once)
+        free(m->active);
+    while((p=m->once_head)!=NULL) {
+        m->once_head = p->next;
+        free(p);
+    }
+    for(i=0; i<m->npolls; i++)
+        free(m->polls[i]);
+    free(m->polls);
+    free(m);
+}
+
+void mbmaster_set_timeout(struct mbmaster *m, unsigned timeout_ms)
+{
+    m->timeout_us = timeout_ms*1000u;
+}
+
+int mbmaster_fd(const struct mbmaster *m)
+{
+    return m->fd;
+}
+
+int mbmaster_timer_fd(const struct mbmaster *m)
+{
+    return m->tfd;
+}
+
+const struct mbmaster_stats *mbmaster_stats(const struct mbmaster *m, uint8_t unit)
+{
+    return unit<248 ? &m->stats[unit] : NULL;
+}
+
+static struct mbmaster_poll *mbmaster_build(uint8_t unit, const uint8_t *pdu, size_t n,
+                                            mbmaster_cb cb, void *arg)
+{
+    struct mbmaster_poll *p;
+
+    if(n<1 || n>RTU_MAX_FRAME-3 || unit>247) {
+        errno = EINVAL;
+        return NULL;
+    }
+    p = calloc(1, sizeof(*p));
+    if(!p)
+        return NULL;
+
+    p->frame[0] = unit;
+    memcpy(p->frame+1, pdu, n);
+    p->len = rtu_add_crc(p->frame, 1+n);
+    p->cb = cb;
+    p->arg = arg;
+    return p;
+}
+
+static void mbmaster_start(struct mbmaster *m);
+
+int mbmaster_submit(struct mbmaster *m, uint8_t unit,
+                    const uint8_t *pdu, size_t n,
+                    mbmaster_cb cb, void *arg)
+{
+    struct mbmaster_poll *p = mbmaster_build(unit, pdu, n, cb, arg);
+    if(!p)
+        return -1;
+
+    if(m->once_tail)
+        m->once_tail->next = p;
+    else
+        m->once_head = p;
+    m->once_tail = p;
+
+    mbmaster_start(m);
+    return 0;
+}
+
+struct mbmaster_poll *mbmaster_add_poll(struct mbmaster *m, uint8_t unit,
+                                        const uint8_t *pdu, size_t n,
+                                        unsigned period_ms,
+                                        mbmaster_cb cb, void *arg)
+{
+    struct mbmaster_poll *p = mbmaster_build(unit, pdu, n, cb, arg), **polls;
+    if(!p)
+        return NULL;
+
+    polls = realloc(m->polls, (m->npolls+1)*sizeof(*polls));
+    if(!polls) {
+        free(p);
+        return NULL;
+    }
+    m->polls = polls;
+    m->polls[m->npolls++] = p;
+
+    p->period = period_ms*1000ull;
+    p->due = now_us();
+
+    mbmaster_start(m);
+    return p;
+}
+
+//! Send the next request if the line is idle, or wait until one is due
+static void mbmaster_start(struct mbmaster *m)
+{
+    struct mbmaster_poll *next = NULL;
+    uint64_t now;
+    size_t i, pos = 0;
+
+    if(m->state!=MASTER_IDLE)
+        return;
+
+    if(m->once_head) {
+        next = m->once_head;
+        m->once_head = next->next;
+        if(!m->once_head)
+            m->once_tail = NULL;
+        m->active_once = 1;
+
+    } else if(m->npolls) {
+        // earliest due
+        for(i=1; i<m->npolls; i++) {
+            if(m->polls[i]->due < m->polls[pos]->due)
+                pos = i;
+        }
+        next = m->polls[pos];
+
+        now = now_us();
+        if(next->due>now) {
+            timer_at(m, next->due);
+            return;
+        }
+        // next period.  Skip any missed completely
+        next->due += next->period;
+        if(next->due<now)
+            next->due = now;
+        m->active_once = 0;
+
+    } else {
+        return;
+    }
+
+    {
+        size_t off = 0;
+        while(off<next->len) {
+            struct pollfd pfd = {m->fd, POLLOUT, 0};
+            ssize_t ret = write(m->fd, next->frame+off, next->len-off);
+            if(ret>=0)
+                off += ret;
+            else if(errno==EAGAIN)
+                poll(&pfd, 1, 100);
+            else if(errno!=EINTR)
+                break;
+        }
+    }
+
+    m->active = next;
+    m->rxlen = 0;
+    m->sent = now_us();
+    m->stats[next->frame[0]].requests++;
+
+    // timeouts from end of transmission
+    now = m->sent + next->len*11000000ull/m->baud;
+    if(next->frame[0]==0) {
+        m->state = MASTER_GAP;
+        m->until = now + BCAST_DELAY_US;
+    } else {
+        m->state = MASTER_REPLY;
+        m->until = now + m->timeout_us;
+    }
+    timer_at(m, m->until);
+}
+
+//! Active request is complete.  Callback, then wait for gap
+static void mbmaster_done(struct mbmaster *m, int status)
+{
+    struct mbmaster_poll *p = m->active;
+    struct mbmaster_stats *S = &m->stats[p->frame[0]];
+    uint64_t now = now_us();
+
+    if(status>=0 && p->frame[0]!=0) {
+        uint32_t lat = now>m->sent ? now-m->sent : 0;
+        S->replies++;
+        if(status>0)
+            S->exceptions++;
+        if(S->replies==1 || lat<S->lat_min)
+            S->lat_min = lat;
+        if(lat>S->lat_max)
+            S->lat_max = lat;
+        S->lat_last = lat;
+        S->lat_sum += lat;
+    } else if(status==-ETIMEDOUT) {
+        S->timeouts++;
+    } else if(status<0) {
+        S->invalid++;
+    }
+
+    m->active = NULL;
+    m->state = MASTER_GAP;
+    m->until = now+m->gap_us;
+    timer_at(m, m->until);
+
+    if(p->cb)
+        (*p->cb)(p->arg, status, status>=0 && m->rxlen ? m->rx : NULL, m->rxlen);
+    if(m->active_once)
+        free(p);
+    m->rxlen = 0;
+}
+
+static int mbmaster_read(struct mbmaster *m)
+{
+    uint8_t buf[RTU_MAX_FRAME];
+
+    while(1) {
+        ssize_t n = read(m->fd, buf, sizeof(buf));
+        int len;
+
+        if(n<0 && errno==EINTR)
+            continue;
+        else if(n<0 && errno==EAGAIN)
+            return 0;
+        else if(n<=0)
+            return -1;
+
+        if(m->state!=MASTER_REPLY) {
+            // unexpected.  discard and restart gap
+            if(m->state==MASTER_GAP) {
+                m->until = now_us()+m->gap_us;
+                timer_at(m, m->until);
+            }
+            continue;
+        }
+
+        if((size_t)n>sizeof(m->rx)-m->rxlen)
+            n = sizeof(m->rx)-m->rxlen;
+        memcpy(m->rx+m->rxlen, buf, n);
+        m->rxlen += n;
+
+        len = rtu_reply_len(m->rx, m->rxlen);
+        if(len<0 || len>RTU_MAX_FRAME || (len>0 && (size_t)len<m->rxlen)) {
+            mbmaster_done(m, -EBADMSG);
+
+        } else if(len>0 && (size_t)len==m->rxlen) {
+            const uint8_t *req = m->active->frame;
+            if(rtu_check(m->rx, len) || m->rx[0]!=req[0] || (m->rx[1]&0x7f)!=req[1])
+                mbmaster_done(m, -EBADMSG);
+            else
+                mbmaster_done(m, m->rx[1]&0x80 ? m->rx[2] : 0);
+        }
+    }
+}
+
+int mbmaster_process(struct mbmaster *m)
+{
+    uint64_t cnt;
+    ssize_t nread;
+    int ret = mbmaster_read(m);
+
+    // clear timer expiration.  state is checked against the clock anyway.
+    nread = read(m->tfd, &cnt, sizeof(cnt));
+    (void)nread;
+
+    if(m->state!=MASTER_IDLE && now_us()>=m->until) {
+        if(m->state==MASTER_REPLY)
+            mbmaster_done(m, -ETIMEDOUT);
+        else if(m->active)
+            mbmaster_done(m, 0); // broadcast turnaround complete
+        else
+            m->state = MASTER_IDLE;
+    }
+
+    mbmaster_start(m);
+    return ret;
+}
+
+int mbmaster_run(struct mbmaster *m, volatile int *stop)
+{
+    while(!*stop) {
+        struct pollfd pfd[2] = {{m->fd, POLLIN, 0}, {m->tfd, POLLIN, 0}};
+        int ret = poll(pfd, 2, 100);
+        if(ret<0 && errno!=EINTR)
+            return -1;
+        else if(ret>0 && mbmaster_process(m))
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+/** Modbus RTU master with poll scheduler
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef MBMASTER_H
+#define MBMASTER_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Event driven Modbus RTU master for one serial line (host only).
+ *
+ * Requests are periodic polls, or one-shot requests which go
+ * ahead of any polls which are due.  The next request is sent as
+ * soon as the line is idle: after the reply (or timeout), and the
+ * t3.5 gap.  Polls are sent earliest due first.
+ *
+ * All timing (reply timeout, gap, poll period) uses one timerfd.
+ * Add mbmaster_fd() and mbmaster_timer_fd() to a poll/epoll loop,
+ * and call mbmaster_process() when either is readable.
+ * Or call mbmaster_run().
+ */
+struct mbmaster;
+struct mbmaster_poll;
+
+/** @brief Completion callback
+ *
+ * status is 0 for a normal reply, >0 for an exception
+ * (code), or -ETIMEDOUT or -EBADMSG.
+ * reply is the complete RTU frame, or NULL.
+ * Broadcasts complete with status 0 and no reply.
+ */
+typedef void (*mbmaster_cb)(void *arg, int status, const uint8_t *reply, size_t len);
+
+//! Per unit statistics
+struct mbmaster_stats {
+    unsigned long requests, replies, exceptions, timeouts, invalid;
+    //! Request written to reply received.  micro-seconds
+    uint32_t lat_min, lat_max, lat_last;
+    uint64_t lat_sum;
+};
+
+/** @brief Open a serial port (or pty)
+ *
+ * Returns NULL on error.
+ */
+struct mbmaster *mbmaster_create(const char *port, unsigned baud);
+
+void mbmaster_destroy(struct mbmaster *m);
+
+//! Reply timeout.  Default 1000 ms
+void mbmaster_set_timeout(struct mbmaster *m, unsigned timeout_ms);
+
+/** @brief Queue a one-shot request
+ *
+ * pdu is the function code and data (without unit or CRC).
+ * Returns 0 or -1 on error.
+ */
+int mbmaster_submit(struct mbmaster *m, uint8_t unit,
+                    const uint8_t *pdu, size_t n,
+                    mbmaster_cb cb, void *arg);
+
+/** @brief Add a periodic request
+ *
+ * Sent every period_ms, or as often as possible if 0.
+ * Returns NULL on error.
+ */
+struct mbmaster_poll *mbmaster_add_poll(struct mbmaster *m, uint8_t unit,
+                                        const uint8_t *pdu, size_t n,
+                                        unsigned period_ms,
+                                        mbmaster_cb cb, void *arg);
+
+//! Serial port file descriptor
+int mbmaster_fd(const struct mbmaster *m);
+//! timerfd file descriptor
+int mbmaster_timer_fd(const struct mbmaster *m);
+
+/** @brief Handle any pending I/O and timer events
+ *
+ * Does not block.  Callbacks are made from here.
+ * Returns 0, or -1 on a serial port error.
+ */
+int mbmaster_process(struct mbmaster *m);
+
+//! Process events until *stop is non-zero
+int mbmaster_run(struct mbmaster *m, volatile int *stop);
+
+const struct mbmaster_stats *mbmaster_stats(const struct mbmaster *m, uint8_t unit);
+
+#endif // MBMASTER_H
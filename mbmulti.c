@@ -0,0 +1,411 @@
+/** Multi-port Modbus RTU poller
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Polls many serial lines from a small pool of worker threads.
+ * Each worker runs an epoll loop over the mbmaster instances
+ * (see mbmaster.h) of the lines given to it.
+ *
+ *  $ ./mbmulti-HOST.elf -j 4 /dev/ttyUSB0@1:0:12,2:0:12 /dev/ttyUSB1@1:0:12
+ *
+ * Lines are given to workers before starting, heaviest first,
+ * each to the worker with the least load so far.  Load is the
+ * number of polls of a line.
+ *
+ * Benchmark mode runs host builds of the mbus server (rtusim.c)
+ * on N ptys, each polled as fast as possible, and reports the
+ * aggregate transactions per second for each N.  The simulated
+ * lines send each reply in pieces (-F), as a UART delivers it,
+ * so replies span several read()s.  Any invalid reply fails the run.
+ *
+ *  $ ./mbmulti-HOST.elf -j 4 -d 3 -B 1,2,4,8,16,32
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "mbmaster.h"
+#include "rtusim.h"
+
+struct worker;
+
+struct line {
+    const char *path;
+    struct mbmaster *M;
+    unsigned load;
+    struct worker *W;
+};
+
+struct worker {
+    pthread_t tid;
+    int efd;
+    unsigned load, nlines;
+};
+
+static volatile int stop, interrupted;
+
+static void handler(int num)
+{
+    stop = 1;
+    if(num!=SIGALRM)
+        interrupted = 1;
+}
+
+static void *worker_run(void *raw)
+{
+    struct worker *W = raw;
+
+    while(!stop) {
+        struct epoll_event evs[32];
+        int n = epoll_wait(W->efd, evs, 32, 100), i;
+
+        if(n<0 && errno==EINTR)
+            continue;
+        else if(n<0) {
+            perror("epoll_wait");
+            stop = 1;
+            break;
+        }
+
+        for(i=0; i<n; i++) {
+            struct line *L = evs[i].data.ptr;
+            if(mbmaster_process(L->M)) {
+                fprintf(stderr, "%s: I/O error\n", L->path);
+                epoll_ctl(W->efd, EPOLL_CTL_DEL, mbmaster_fd(L->M), NULL);
+                epoll_ctl(W->efd, EPOLL_CTL_DEL, mbmaster_timer_fd(L->M), NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int cmp_load(const void *a, const void *b)
+{
+    const struct line *A = a, *B = b;
+    return (int)B->load - (int)A->load;
+}
+
+//! Give lines to workers, heaviest first, to the least loaded
+static int assign(struct line *lines, unsigned nlines,
+                  struct worker *workers, unsigned nworkers)
+{
+    unsigned i, j;
+
+    qsort(lines, nlines, sizeof(*lines), cmp_load);
+
+    for(i=0; i<nlines; i++) {
+        struct line *L = &lines[i];
+        struct worker *W = &workers[0];
+        struct epoll_event ev;
+
+        for(j=1; j<nworkers; j++) {
+            if(workers[j].load<W->load ||
+                    (workers[j].load==W->load && workers[j].nlines<W->nlines))
+                W = &workers[j];
+        }
+        L->W = W;
+        W->load += L->load;
+        W->nlines++;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = L;
+        if(epoll_ctl(W->efd, EPOLL_CTL_ADD, mbmaster_fd(L->M), &ev)
+                || epoll_ctl(W->efd, EPOLL_CTL_ADD, mbmaster_timer_fd(L->M), &ev))
+            return -1;
+    }
+    return 0;
+}
+
+//! Run workers until stopped.  Returns elapsed seconds
+static double run_workers(struct worker *workers, unsigned nworkers)
+{
+    struct timespec start, end;
+    unsigned i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i<nworkers; i++)
+        pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]);
+    for(i=0; i<nworkers; i++)
+        pthread_join(workers[i].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)*1e-9;
+}
+
+static struct worker *workers_create(unsigned nworkers)
+{
+    struct worker *workers = calloc(nworkers, sizeof(*workers));
+    unsigned i;
+    if(!workers)
+        return NULL;
+    for(i=0; i<nworkers; i++) {
+        workers[i].efd = epoll_create1(EPOLL_CLOEXEC);
+        if(workers[i].efd<0) {
+            perror("epoll_create");
+            exit(1);
+        }
+    }
+    return workers;
+}
+
+static void workers_destroy(struct worker *workers, unsigned nworkers)
+{
+    unsigned i;
+    for(i=0; i<nworkers; i++)
+        close(workers[i].efd);
+    free(workers);
+}
+
+static unsigned long line_replies(const struct line *L, unsigned long *timeouts,
+                                  unsigned long *invalid)
+{
+    unsigned long total = 0;
+    unsigned u;
+    for(u=1; u<248; u++) {
+        const struct mbmaster_stats *S = mbmaster_stats(L->M, u);
+        total += S->replies;
+        if(timeouts)
+            *timeouts += S->timeouts;
+        if(invalid)
+            *invalid += S->invalid;
+    }
+    return total;
+}
+
+static void *sim_run(void *raw)
+{
+    if(rtusim_run(raw, &stop))
+        perror("rtusim_run");
+    return NULL;
+}
+
+/** Benchmark with N simulated lines, replies sent frag bytes at a time.
+ * Returns 1 if any reply was invalid, or -1 on error.
+ */
+static int bench(unsigned nlines, unsigned nworkers, unsigned duration, unsigned frag)
+{
+    struct rtusim **sims = calloc(nlines, sizeof(*sims));
+    pthread_t *simtids = calloc(nlines, sizeof(*simtids));
+    struct line *lines = calloc(nlines, sizeof(*lines));
+    struct worker *workers = workers_create(nworkers);
+    static const uint8_t pdu[] = {3, 0, 0, 0, 10};
+    unsigned long total = 0, timeouts = 0, invalid = 0;
+    double elapsed;
+    unsigned i;
+
+    if(!sims || !simtids || !lines || !workers)
+        return -1;
+
+    stop = 0;
+
+    for(i=0; i<nlines; i++) {
+        sims[i] = rtusim_create(1, 1, 16);
+        if(!sims[i])
+            return -1;
+        rtusim_set_fragment(sims[i], frag);
+        lines[i].path = rtusim_port(sims[i]);
+        lines[i].M = mbmaster_create(lines[i].path, 115200);
+        if(!lines[i].M)
+            return -1;
+        mbmaster_set_timeout(lines[i].M, 100);
+        if(!mbmaster_add_poll(lines[i].M, 1, pdu, sizeof(pdu), 0, NULL, NULL))
+            return -1;
+        lines[i].load = 1;
+        pthread_create(&simtids[i], NULL, sim_run, sims[i]);
+    }
+
+    if(assign(lines, nlines, workers, nworkers))
+        return -1;
+
+    alarm(duration);
+    elapsed = run_workers(workers, nworkers);
+
+    for(i=0; i<nlines; i++) {
+        pthread_join(simtids[i], NULL);
+        total += line_replies(&lines[i], &timeouts, &invalid);
+    }
+
+    printf("%5u %7u %9lu %9.0f %8.0f %8lu %8lu\n", nlines, nworkers, total,
+           total/elapsed, total/elapsed/nlines, timeouts, invalid);
+    fflush(stdout);
+
+    for(i=0; i<nlines; i++) {
+        mbmaster_destroy(lines[i].M);
+        rtusim_destroy(sims[i]);
+    }
+    workers_destroy(workers, nworkers);
+    free(lines);
+    free(simtids);
+    free(sims);
+    return invalid ? 1 : 0;
+}
+
+// parse "tty@unit:addr:count,unit:addr:count..."
+static int parse_line(struct line *L, char *arg, unsigned baud, unsigned timeout, unsigned period)
+{
+    char *at = strchr(arg, '@'), *tok, *save = NULL;
+
+    if(!at)
+        return -1;
+    *at = '\0';
+    L->path = arg;
+
+    L->M = mbmaster_create(L->path, baud);
+    if(!L->M) {
+        perror(L->path);
+        return -1;
+    }
+    mbmaster_set_timeout(L->M, timeout);
+
+    for(tok=strtok_r(at+1, ",", &save); tok; tok=strtok_r(NULL, ",", &save)) {
+        unsigned unit, addr, count;
+        uint8_t pdu[5];
+
+        if(sscanf(tok, "%u:%u:%u", &unit, &addr, &count)!=3
+                || unit<1 || unit>247 || count<1 || count>125 || addr+count>0x10000) {
+            fprintf(stderr, "Invalid range '%s'\n", tok);
+            return -1;
+        }
+        pdu[0] = 3;
+        pdu[1] = addr>>8;
+        pdu[2] = addr;
+        pdu[3] = count>>8;
+        pdu[4] = count;
+        if(!mbmaster_add_poll(L->M, unit, pdu, sizeof(pdu), period, NULL, NULL))
+            return -1;
+        L->load++;
+    }
+    return L->load ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-b baud] [-t ms] [-p ms] [-d sec] <tty@unit:addr:count[,...]> ...\n"
+            "       %s [-j threads] [-d sec] [-F nbytes] -B N[,N...]\n"
+            "  -j threads  Worker threads (default 4)\n"
+            "  -b baud     Serial baud rate (default 115200)\n"
+            "  -t ms       Reply timeout (default 1000)\n"
+            "  -p ms       Poll period (default 0, as fast as possible)\n"
+            "  -d sec      Run time (default 10, 0 until interrupted)\n"
+            "  -B N,...    Benchmark with N simulated lines\n"
+            "  -F nbytes   Benchmark replies sent in pieces of nbytes (default 4, 0 whole)\n",
+            name, name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned nworkers = 4, baud = 115200, timeout = 1000, period = 0, duration = 10, frag = 4;
+    const char *benchlist = NULL;
+    struct sigaction act;
+    struct line *lines;
+    struct worker *workers;
+    unsigned nlines, i;
+    double elapsed;
+    int opt, failed = 0;
+
+    while((opt=getopt(argc, argv, "j:b:t:p:d:B:F:h"))!=-1) {
+        switch(opt) {
+        case 'j': nworkers = atoi(optarg); break;
+        case 'b': baud = atoi(optarg); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'p': period = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'B': benchlist = optarg; break;
+        case 'F': frag = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt!='h';
+        }
+    }
+    if(nworkers<1 || (!benchlist && optind==argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGALRM, &act, NULL);
+
+    if(benchlist) {
+        const char *pos = benchlist;
+        if(!duration)
+            duration = 3;
+        printf("lines threads   replies  trans/s  per line timeouts  invalid\n");
+        while(*pos && !interrupted) {
+            char *end;
+            unsigned long n = strtoul(pos, &end, 10);
+            int ret;
+            if(end==pos || n==0) {
+                usage(argv[0]);
+                return 1;
+            }
+            ret = bench(n, nworkers, duration, frag);
+            if(ret<0) {
+                perror("bench");
+                return 1;
+            } else if(ret) {
+                failed = 1;
+            }
+            pos = *end==',' ? end+1 : end;
+        }
+        return failed;
+    }
+
+    nlines = argc-optind;
+    lines = calloc(nlines, sizeof(*lines));
+    workers = workers_create(nworkers);
+    if(!lines || !workers)
+        return 1;
+
+    for(i=0; i<nlines; i++) {
+        if(parse_line(&lines[i], argv[optind+i], baud, timeout, period)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(assign(lines, nlines, workers, nworkers)) {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    if(duration)
+        alarm(duration);
+    elapsed = run_workers(workers, nworkers);
+
+    printf("line                     worker  replies timeouts  invalid  trans/s\n");
+    for(i=0; i<nlines; i++) {
+        unsigned long timeouts = 0, invalid = 0,
+                      n = line_replies(&lines[i], &timeouts, &invalid);
+        printf("%-24s %6u %8lu %8lu %8lu %8.1f\n", lines[i].path,
+               (unsigned)(lines[i].W-workers), n, timeouts, invalid, n/elapsed);
+        mbmaster_destroy(lines[i].M);
+    }
+
+    workers_destroy(workers, nworkers);
+    free(lines);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/** Modbus read request planner
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbplan.h"
+
+static int cmp_u16(const void *a, const void *b)
+{
+    return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+//! First gap ending at or after addr.  Gaps are few, so linear search.
+static const struct mbplan_gap *next_gap(const struct mbplan_device *dev, uint16_t addr)
+{
+    const struct mbplan_gap *best = NULL;
+    size_t i;
+    for(i=0; i<dev->ngaps; i++) {
+        const struct mbplan_gap *G = &dev->gaps[i];
+        if(G->last>=addr && (!best || G->first<best->first))
+            best = G;
+    }
+    return best;
+}
+
+unsigned mbplan_max_hole(const struct mbplan_device *dev)
+{
+    unsigned long long baud = dev->baud ? dev->baud : 9600,
+                       turn = dev->turnaround_us ? dev->turnaround_us : 1000,
+                       gap, trip;
+
+    if(dev->max_hole)
+        return dev->max_hole;
+
+    // in units of 1/baud micro-seconds.  11 bit characters
+    gap = baud>19200 ? 1750*baud : 35*11*1000000ull/10;
+    trip = (8+5)*11*1000000ull + 2*gap + turn*baud;
+
+    // each hole register is 2 characters
+    return trip/(2*11*1000000ull);
+}
+
+int mbplan_reads(const struct mbplan_device *dev,
+                 const uint16_t *want, size_t nwant,
+                 struct mbplan_read *out, size_t nout)
+{
+    uint16_t *addrs;
+    size_t i = 0, nreads = 0;
+    unsigned max = dev->max_regs ? dev->max_regs : 125,
+             max_hole = mbplan_max_hole(dev);
+
+    if(nwant==0)
+        return 0;
+
+    addrs = malloc(nwant*sizeof(*addrs));
+    if(!addrs)
+        return -1;
+    memcpy(addrs, want, nwant*sizeof(*addrs));
+    qsort(addrs, nwant, sizeof(*addrs), cmp_u16);
+
+    while(i<nwant) {
+        uint16_t start = addrs[i], end = start;
+        const struct mbplan_gap *G = next_gap(dev, start);
+        uint32_t limit = start+max-1u; // last register which may be read
+
+        if(G && G->first<=start) {
+            // wanted register can't be read
+            free(addrs);
+            return -1;
+        }
+        if(G && G->first-1u<limit)
+            limit = G->first-1u;
+
+        for(i++; i<nwant && addrs[i]<=limit; i++) {
+            if(addrs[i]>end+1u+max_hole)
+                break;
+            end = addrs[i];
+        }
+
+        if(nreads<nout) {
+            out[nreads].addr = start;
+            out[nreads].count = end-start+1u;
+        }
+        nreads++;
+    }
+
+    free(addrs);
+    return nreads;
+}
@@ -0,0 +1,86 @@
+/** Modbus read request planner
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef MBPLAN_H
+#define MBPLAN_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Plan function 3 reads which cover a set of wanted registers
+ * of one unit in the least bus time.
+ *
+ * Reads may include registers which weren't asked for, but never
+ * include a gap (registers which the device rejects with an
+ * exception), and never exceed the device's max. registers per read.
+ * Each read starts at the lowest uncovered address, and is extended
+ * over a hole (unwanted registers) only if sending the hole in the
+ * reply takes less time than another round trip.  Each read is then
+ * trimmed to end at the last wanted register it covers.
+ *
+ * A round trip costs the request (8 bytes), the reply header and CRC
+ * (5 bytes), two t3.5 gaps, and the device turnaround.  A hole costs
+ * 2 bytes per register.  Bytes are 11 bit characters.  So a plan
+ * never takes longer than one read per wanted register.
+ */
+
+//! Range of registers which can't be read (inclusive)
+struct mbplan_gap {
+    uint16_t first, last;
+};
+
+struct mbplan_device {
+    //! Max. registers per read.  125 (full size frame), or MAX_BUFFER/2 of mbus.c
+    uint16_t max_regs;
+    /* Don't read across more than this many unwanted registers.
+     * 0 to find from baud and turnaround_us (see mbplan_max_hole()).
+     * 0xffff for no limit, which gives the fewest reads.
+     */
+    uint16_t max_hole;
+    //! Serial line speed.  0 for 9600
+    unsigned baud;
+    //! Device turnaround, request to reply, in micro-seconds.  0 for 1000
+    unsigned turnaround_us;
+    const struct mbplan_gap *gaps;
+    size_t ngaps;
+};
+
+struct mbplan_read {
+    uint16_t addr, count;
+};
+
+/** @brief Largest hole to read across
+ *
+ * max_hole if set.  Otherwise the largest hole which takes
+ * no longer to send than a round trip.  About 10 registers
+ * at 9600 baud, and 30 at 115200.
+ */
+unsigned mbplan_max_hole(const struct mbplan_device *dev);
+
+/** @brief Plan reads
+ *
+ * want[] may be in any order, with duplicates.
+ * Up to nout reads are stored in out[].
+ *
+ * Returns the number of reads needed (which may be more than nout),
+ * or -1 if a wanted register is in a gap, or out of memory.
+ */
+int mbplan_reads(const struct mbplan_device *dev,
+                 const uint16_t *want, size_t nwant,
+                 struct mbplan_read *out, size_t nout);
+
+#endif // MBPLAN_H
@@ -0,0 +1,219 @@
+/** Read planner benchmark
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Compare round trips, and estimated bus time, of one read
+ * per wanted register against planned reads (mbplan.c)
+ * for some typical scan lists.  Each plan is made for the baud rate,
+ * and is checked to cover every wanted register without reading a gap,
+ * and to take no longer than one read per register.
+ *
+ * Bus time counts request and reply bytes (11 bit characters),
+ * two t3.5 gaps, and a fixed device turnaround per transaction.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mbplan.h"
+
+#define NELEMENTS(X) (sizeof(X)/sizeof(*(X)))
+
+//! Device turnaround, request to reply.  micro-seconds
+#define TURNAROUND_US 1000
+
+struct scan {
+    const char *name;
+    struct mbplan_device dev;
+    uint16_t want[512];
+    size_t nwant;
+};
+
+static double bus_us(unsigned baud, unsigned nregs)
+{
+    double tchar = 11e6/baud,
+           gap = baud>19200 ? 1750 : 3.5*tchar;
+    // 8 byte request.  5+2*n byte reply
+    return (8 + 5+2*nregs)*tchar + 2*gap + TURNAROUND_US;
+}
+
+// is addr in a gap
+static int in_gap(const struct mbplan_device *dev, unsigned addr)
+{
+    size_t i;
+    for(i=0; i<dev->ngaps; i++) {
+        if(addr>=dev->gaps[i].first && addr<=dev->gaps[i].last)
+            return 1;
+    }
+    return 0;
+}
+
+static int check(const struct scan *S, const struct mbplan_read *R, int n)
+{
+    size_t i;
+    int j;
+    unsigned max = S->dev.max_regs ? S->dev.max_regs : 125;
+
+    for(j=0; j<n; j++) {
+        unsigned a;
+        if(R[j].count==0 || R[j].count>max)
+            return 1;
+        for(a=R[j].addr; a<R[j].addr+R[j].count; a++) {
+            if(in_gap(&S->dev, a))
+                return 1;
+        }
+    }
+    for(i=0; i<S->nwant; i++) {
+        for(j=0; j<n; j++) {
+            if(S->want[i]>=R[j].addr && S->want[i]-R[j].addr<R[j].count)
+                break;
+        }
+        if(j==n)
+            return 1;
+    }
+    return 0;
+}
+
+static void add(struct scan *S, unsigned addr)
+{
+    if(S->nwant<NELEMENTS(S->want))
+        S->want[S->nwant++] = addr;
+}
+
+static const struct mbplan_gap shield_gaps[] = {{12, 0xffff}};
+static const struct mbplan_gap plc_gaps[] = {{100, 199}, {420, 499}, {1000, 0xffff}};
+
+static unsigned nfail;
+
+static void run(struct scan *S)
+{
+    static struct mbplan_read R[512];
+    unsigned bauds[] = {9600, 115200}, b;
+    size_t i;
+
+    printf("%-24s %4zu wanted", S->name, S->nwant);
+
+    S->dev.turnaround_us = TURNAROUND_US;
+
+    for(b=0; b<NELEMENTS(bauds); b++) {
+        double naive = 0, plan = 0;
+        int n, ok;
+
+        S->dev.baud = bauds[b];
+        n = mbplan_reads(&S->dev, S->want, S->nwant, R, NELEMENTS(R));
+        if(n<0 || n>(int)NELEMENTS(R)) {
+            printf("  %6u: plan failed", bauds[b]);
+            nfail++;
+            continue;
+        }
+
+        for(i=0; i<S->nwant; i++)
+            naive += bus_us(bauds[b], 1);
+        for(i=0; i<(size_t)n; i++)
+            plan += bus_us(bauds[b], R[i].count);
+
+        // slower than no plan is a failure
+        ok = !check(S, R, n) && plan<=naive;
+        if(!ok)
+            nfail++;
+
+        printf("  %6u: %s %3d reads %7.1f -> %6.1f ms", bauds[b],
+               ok ? "ok  " : "FAIL", n, naive*1e-3, plan*1e-3);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct scan S;
+    unsigned i, j;
+
+    srand(42);
+
+    printf("%-24s              bus time (baud: reads, one read per register -> planned)\n", "");
+
+    // ioshield.  12 registers, as asked for by a typical HMI
+    memset(&S, 0, sizeof(S));
+    S.name = "ioshield";
+    S.dev.max_regs = 10; // MAX_BUFFER=20
+    S.dev.gaps = shield_gaps;
+    S.dev.ngaps = NELEMENTS(shield_gaps);
+    add(&S, 1); add(&S, 10); add(&S, 0); add(&S, 3); add(&S, 5); add(&S, 2);
+    run(&S);
+
+    // same, full size frames
+    S.name = "ioshield (250)";
+    S.dev.max_regs = 125;
+    run(&S);
+
+    // HMI screen.  5 groups of 4-10 points, within 1000 registers
+    memset(&S, 0, sizeof(S));
+    S.name = "HMI clusters";
+    S.dev.gaps = plc_gaps;
+    S.dev.ngaps = NELEMENTS(plc_gaps);
+    for(i=0; i<5; i++) {
+        static const unsigned bases[5] = {0, 30, 220, 330, 600};
+        unsigned base = bases[i], n = 4+rand()%7;
+        for(j=0; j<n; j++)
+            add(&S, base+rand()%16);
+    }
+    run(&S);
+
+    // same, split if 8 or more unused registers
+    S.name = "HMI clusters, hole<8";
+    S.dev.max_hole = 8;
+    run(&S);
+
+    // historian.  Every 5th register, with gaps
+    memset(&S, 0, sizeof(S));
+    S.name = "historian stride 5";
+    S.dev.gaps = plc_gaps;
+    S.dev.ngaps = NELEMENTS(plc_gaps);
+    for(i=0; i<1000; i+=5) {
+        if(!in_gap(&S.dev, i))
+            add(&S, i);
+    }
+    run(&S);
+
+    // sparse.  Random points in 0-999
+    memset(&S, 0, sizeof(S));
+    S.name = "random sparse";
+    S.dev.gaps = plc_gaps;
+    S.dev.ngaps = NELEMENTS(plc_gaps);
+    while(S.nwant<60) {
+        unsigned a = rand()%1000;
+        if(!in_gap(&S.dev, a))
+            add(&S, a);
+    }
+    run(&S);
+
+    // same, split on holes of more than 4
+    S.name = "random sparse, hole<=4";
+    S.dev.max_hole = 4;
+    run(&S);
+
+    // a gap in the wanted set is an error
+    memset(&S, 0, sizeof(S));
+    S.dev.gaps = plc_gaps;
+    S.dev.ngaps = NELEMENTS(plc_gaps);
+    add(&S, 150);
+    if(mbplan_reads(&S.dev, S.want, S.nwant, NULL, 0)!=-1) {
+        printf("Read of gap not rejected\n");
+        nfail++;
+    }
+
+    return nfail!=0;
+}
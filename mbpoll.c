@@ -0,0 +1,174 @@
+/** Modbus RTU poller
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Polls register ranges of many units as fast as the line allows
+ * (or at a fixed period) and reports per unit statistics.
+ *
+ *  $ ./mbsim-HOST.elf -n 8 -l /tmp/mbsim0 &
+ *  $ ./mbpoll-HOST.elf -d 5 /tmp/mbsim0 1:0:10 2:0:10 3:0:10 ...
+ *
+ * Ranges are unit:addr:count with count<=125.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mbmaster.h"
+
+static volatile int stop;
+
+static void handler(int num)
+{
+    stop = 1;
+}
+
+struct range {
+    unsigned unit, addr, count;
+};
+
+static int verbose;
+
+static void poll_done(void *arg, int status, const uint8_t *reply, size_t len)
+{
+    const struct range *R = arg;
+    unsigned i;
+
+    if(!verbose)
+        return;
+
+    printf("%u:%u:%u", R->unit, R->addr, R->count);
+    if(status<0)
+        printf(" error %d\n", status);
+    else if(status>0)
+        printf(" exception %d\n", status);
+    else {
+        for(i=0; 3+2*i+1<len-2; i++)
+            printf(" %04x", reply[3+2*i]<<8 | reply[4+2*i]);
+        printf("\n");
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-b baud] [-t ms] [-p ms] [-d sec] [-v] <tty> <unit:addr:count> ...\n"
+            "  -b baud  Serial baud rate (default 115200)\n"
+            "  -t ms    Reply timeout (default 1000)\n"
+            "  -p ms    Poll period (default 0, as fast as possible)\n"
+            "  -d sec   Run time (default 10, 0 until interrupted)\n"
+            "  -v       Print each reply\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned baud = 115200, timeout = 1000, period = 0, duration = 10;
+    unsigned i, nranges;
+    struct range *ranges;
+    struct mbmaster *M;
+    struct sigaction act;
+    struct timespec start, end;
+    unsigned long total = 0;
+    double elapsed;
+    int opt, ret;
+
+    while((opt=getopt(argc, argv, "b:t:p:d:vh"))!=-1) {
+        switch(opt) {
+        case 'b': baud = atoi(optarg); break;
+        case 't': timeout = atoi(optarg); break;
+        case 'p': period = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return opt!='h';
+        }
+    }
+    if(argc-optind<2) {
+        usage(argv[0]);
+        return 1;
+    }
+    nranges = argc-optind-1;
+
+    M = mbmaster_create(argv[optind], baud);
+    ranges = calloc(nranges, sizeof(*ranges));
+    if(!M || !ranges) {
+        perror(argv[optind]);
+        return 1;
+    }
+    mbmaster_set_timeout(M, timeout);
+
+    for(i=0; i<nranges; i++) {
+        struct range *R = &ranges[i];
+        uint8_t pdu[5];
+
+        if(sscanf(argv[optind+1+i], "%u:%u:%u", &R->unit, &R->addr, &R->count)!=3
+                || R->unit<1 || R->unit>247 || R->count<1 || R->count>125
+                || R->addr+R->count>0x10000) {
+            fprintf(stderr, "Invalid range '%s'\n", argv[optind+1+i]);
+            return 1;
+        }
+
+        pdu[0] = 3;
+        pdu[1] = R->addr>>8;
+        pdu[2] = R->addr;
+        pdu[3] = R->count>>8;
+        pdu[4] = R->count;
+        if(!mbmaster_add_poll(M, R->unit, pdu, sizeof(pdu), period, poll_done, R)) {
+            perror("mbmaster_add_poll");
+            return 1;
+        }
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGALRM, &act, NULL);
+    if(duration)
+        alarm(duration);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = mbmaster_run(M, &stop);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(ret)
+        perror("mbmaster_run");
+
+    elapsed = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)*1e-9;
+
+    printf("unit requests  replies  except timeouts  invalid  lat min/avg/max (ms)\n");
+    for(i=1; i<248; i++) {
+        const struct mbmaster_stats *S = mbmaster_stats(M, i);
+        if(!S->requests)
+            continue;
+        printf("%4u %8lu %8lu %7lu %8lu %8lu  ", i, S->requests, S->replies,
+               S->exceptions, S->timeouts, S->invalid);
+        if(S->replies)
+            printf("%.3f/%.3f/%.3f\n", S->lat_min*1e-3,
+                   S->lat_sum*1e-3/S->replies, S->lat_max*1e-3);
+        else
+            printf("-\n");
+        total += S->replies;
+    }
+    printf("%lu replies in %.2f s (%.1f/s)\n", total, elapsed, total/elapsed);
+
+    mbmaster_destroy(M);
+    free(ranges);
+    return ret!=0;
+}
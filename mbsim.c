@@ -0,0 +1,110 @@
+/** Simulated Modbus RTU bus on a pty
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Runs host builds of the mbus server on a pseudo-terminal
+ * for testing master programs (mbgateway, ...) without hardware.
+ *
+ *  $ ./mbsim-HOST.elf -n 4 -l /tmp/mbsim0 &
+ *  $ ./mbgateway-HOST.elf -p 1502 /tmp/mbsim0
+ *
+ * Servers have unit addresses 1..n (or -u first ...).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "rtusim.h"
+
+static volatile int stop;
+
+static void handler(int num)
+{
+    stop = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-u first] [-n count] [-r nregs] [-d delay_us] [-f nbytes] [-l link]\n"
+            "  -u first     Unit address of first server (default 1)\n"
+            "  -n count     Number of servers (default 1)\n"
+            "  -r nregs     Registers (and coils) per server (default 128)\n"
+            "  -d delay_us  Delay before each reply (default 0)\n"
+            "  -f nbytes    Send replies in pieces of nbytes (default 0, whole)\n"
+            "  -l link      Create symlink to the pty\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned first = 1, count = 1, nregs = 128, delay = 0, frag = 0;
+    const char *link = NULL;
+    struct rtusim *sim;
+    struct sigaction act;
+    int opt, ret;
+
+    while((opt=getopt(argc, argv, "u:n:r:d:f:l:h"))!=-1) {
+        switch(opt) {
+        case 'u': first = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'r': nregs = atoi(optarg); break;
+        case 'd': delay = atoi(optarg); break;
+        case 'f': frag = atoi(optarg); break;
+        case 'l': link = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt!='h';
+        }
+    }
+
+    sim = rtusim_create(first, count, nregs);
+    if(!sim) {
+        perror("rtusim_create");
+        return 1;
+    }
+    rtusim_set_delay(sim, delay);
+    rtusim_set_fragment(sim, frag);
+
+    if(link) {
+        unlink(link);
+        if(symlink(rtusim_port(sim), link)) {
+            perror("symlink");
+            rtusim_destroy(sim);
+            return 1;
+        }
+    }
+
+    printf("%s\n", rtusim_port(sim));
+    fflush(stdout);
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    ret = rtusim_run(sim, &stop);
+    if(ret)
+        perror("rtusim_run");
+
+    fprintf(stderr, "%lu replies\n", rtusim_count(sim));
+
+    if(link)
+        unlink(link);
+    rtusim_destroy(sim);
+    return ret!=0;
+}
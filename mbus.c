@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include "mbus.h"
+#include "crc16.h"
 
 #include <string.h>
 
@@ -27,224 +28,878 @@ uint16_t bswap16(uint16_t in)
 
 #ifndef __AVR__
 #  include <endian.h>
-uint16_t _crc16_update(uint16_t, uint8_t);
 #else
-#  include <util/crc16.h>
 #  define htobe16(X) ((uint16_t)bswap16(X))
 #  define be16toh(X) ((uint16_t)bswap16(X))
 #  define htole16(X) ((uint16_t)(X))
 #  define le16toh(X) ((uint16_t)(X))
 #endif
 
-#if MAX_BUFFER>=256
-#  error MAX_BUFFER must be <256
+#define STATE_REPLY 1
+//! Last two bytes of reply are filled from crc_acc as they are sent
+#define STATE_TXCRC 2
+/* Discard received bytes until the end of the frame.  Frame for another
+ * unit, or a broadcast which won't be answered.  See mbus_skip_byte()
+ */
+#define STATE_SKIP 4
+//! Reply data comes from the register map or ops->stream_reg as it is sent.  Implies STATE_TXCRC
+#define STATE_STREAM 8
+
+#ifdef __AVR__
+// register map tables are in flash
+#  define regmap_ptr(X) ((void*)pgm_read_word(&(X)))
+#  define regmap_word(X) pgm_read_word(&(X))
+#  define regmap_byte(X) pgm_read_byte(&(X))
+#else
+#  define regmap_ptr(X) ((void*)(X))
+#  define regmap_word(X) (X)
+#  define regmap_byte(X) (X)
 #endif
 
-struct mbus_single_reg {
-    uint16_t addr;
-    uint16_t data;
-    uint16_t crc;
-};
+void mbus_ctx_init(struct mbus_ctx *ctx, const struct mbus_ops *ops, void *user)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ops = ops;
+    ctx->user = user;
+    ctx->unit = 1;
+    mbus_ctx_rx_clear(ctx);
+}
 
-struct mbus_multi_reply {
-    uint8_t count;
-    uint16_t data[1+MAX_BUFFER/2]; // extra entry for crc
-} __attribute__((packed));
+void mbus_ctx_reset(struct mbus_ctx *ctx)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mbus_ctx_rx_clear(ctx);
+        ctx->state = 0;
+        ctx->status = 0;
+        ctx->in_byte = ctx->out_byte = 0;
+        memset(&ctx->diag, 0, sizeof(ctx->diag));
+        memset(ctx->buf.b_b, 0, sizeof(ctx->buf));
+    }
+}
 
-struct mbus_except {
-    uint8_t code;
-    uint8_t lrc;
-};
 
-struct mbus_message {
-    uint8_t node;
-    uint8_t function;
-    union {
-        struct mbus_single_reg mb_s;
-        struct mbus_multi_reply mb_m;
-        struct mbus_except mb_e;
-    };
-};
+void mbus_ctx_rx_clear(struct mbus_ctx *ctx)
+{
+    ctx->buf_cnt = 8;
+    ctx->buf_pos = 0;
+    ctx->crc_acc = 0xffff;
+    ctx->state &= ~STATE_SKIP;
+}
+
+void mbus_ctx_set_unit(struct mbus_ctx *ctx, uint8_t unit)
+{
+    ctx->unit = unit;
+}
 
-static union {
-    struct mbus_message b_p;
-    uint8_t b_b[sizeof(struct mbus_message)];
-} buf;
+uint8_t mbus_ctx_get_unit(const struct mbus_ctx *ctx)
+{
+    return ctx->unit;
+}
 
-static uint8_t buf_cnt = 8, buf_pos;
+void mbus_ctx_exception(struct mbus_ctx *ctx, uint8_t code)
+{
+    uint8_t sum= ctx->buf.b_p.node;
 
-static uint8_t err_cnt;
+    ctx->buf.b_p.function |= 0x80;
+    sum += ctx->buf.b_p.function;
 
-#define STATE_REPLY 1
-static uint8_t mb_state = 0;
+    ctx->buf.b_p.mb_e.code = code;
+    sum += code;
 
-volatile uint8_t mbus_in_byte;
-volatile uint8_t mbus_out_byte;
-volatile uint8_t mbus_status;
+    ctx->buf.b_p.mb_e.lrc = (~sum)+1;
+
+    ctx->buf_cnt = 4;
+    ctx->state = (ctx->state&~(STATE_TXCRC|STATE_STREAM))|STATE_REPLY;
 
-void mbus_reset(void)
-{
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        mbus_rx_clear();
-        mbus_status = 0;
-        mbus_in_byte = mbus_out_byte = 0;
-        err_cnt = 0;
-        memset(buf.b_b, 0, sizeof(buf));
+        ctx->status |= MBUS_RX_ERROR;
     }
 }
 
+void mbus_ctx_set_regmap(struct mbus_ctx *ctx, const struct mbus_reg *map, uint16_t nregs)
+{
+    ctx->regmap = map;
+    ctx->nregs = map ? nregs : 0;
+}
 
-void mbus_rx_clear(void)
+/* Check that count registers starting at addr are in the map,
+ * and all have one of the access flags.  Returns 0, or exception code.
+ */
+static uint8_t mbus_regmap_check(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t access)
 {
-    buf_cnt = 8;
-    buf_pos = 0;
+    const struct mbus_reg *R;
+
+    if(addr>=ctx->nregs || count>ctx->nregs-addr)
+        return 2;
+
+    for(R=ctx->regmap+addr; count; count--, R++) {
+        if(!(regmap_byte(R->flags)&access))
+            return 2;
+    }
+    return 0;
 }
 
-uint16_t calculate_crc(const uint8_t* d, uint8_t c)
+static uint16_t mbus_regmap_read(struct mbus_ctx *ctx, uint16_t addr)
 {
-    uint16_t r=0xffff;
+    const struct mbus_reg *R = ctx->regmap+addr;
+    uint16_t (*read)(struct mbus_ctx*, uint16_t) = regmap_ptr(R->read);
+    uint16_t *store = regmap_ptr(R->store), value = 0;
 
-    while(c--)
-        r=_crc16_update(r, *d++);
-    return r;
+    if(read)
+        return read(ctx, addr);
+
+    if(store) {
+        // may be updated by an ISR
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            value = *store;
+        }
+    }
+    return value;
 }
 
-void mbus_exception(uint8_t code)
+static void mbus_regmap_write(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
 {
-    uint8_t sum= buf.b_p.node;
+    const struct mbus_reg *R = ctx->regmap+addr;
+    void (*write)(struct mbus_ctx*, uint16_t, uint16_t) = regmap_ptr(R->write);
+    uint16_t *store = regmap_ptr(R->store), mask = regmap_word(R->wmask);
 
-    buf.b_p.function |= 0x80;
-    sum += buf.b_p.function;
+    if(!(regmap_byte(R->flags)&MBUS_REG_W))
+        return; // read only.  ignored
 
-    buf.b_p.mb_e.code = code;
-    sum += code;
+    value &= mask;
 
-    buf.b_p.mb_e.lrc = (~sum)+1;
+    if(write) {
+        write(ctx, addr, value);
 
-    buf_cnt = 4;
-    mb_state |= STATE_REPLY;
+    } else if(store) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *store = (*store&~mask) | value;
+        }
+    }
+}
 
-    err_cnt++;
+// Write registers through the map (functions 6, 16, and 23)
+static void mbus_regmap_write_multi(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, const uint16_t *value)
+{
+    // only unmapped registers are an error.  Writes to read only are ignored
+    uint8_t code = mbus_regmap_check(ctx, addr, count, MBUS_REG_RW);
 
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        mbus_status |= MBUS_RX_ERROR;
+    if(code) {
+        mbus_ctx_exception(ctx, code);
+        return;
     }
+
+    // stop after the first exception
+    for(; count && !(ctx->state&STATE_REPLY); count--)
+        mbus_regmap_write(ctx, addr++, *value++);
 }
 
-static void mbus_dispatch(void)
+uint8_t mbus_ctx_write_reg(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
 {
-    uint16_t crc=calculate_crc(buf.b_b, buf_cnt-2);
+    uint8_t code = mbus_regmap_check(ctx, addr, 1, MBUS_REG_RW);
+
+    if(!code) {
+        uint8_t prev = ctx->state&STATE_REPLY;
+
+        mbus_regmap_write(ctx, addr, value);
+
+        if(!prev && (ctx->state&STATE_REPLY))
+            code = ctx->buf.b_p.mb_e.code;
+    }
+    return code;
+}
 
-    if(le16toh(buf.b_p.mb_s.crc)!=crc) {
-        mbus_exception(4);
+// Read holding registers and build reply (functions 3 and 23)
+static void mbus_read_reply(struct mbus_ctx *ctx, uint16_t addr, uint16_t count)
+{
+    uint8_t cnt = count, code; // valid counts will always be <256
+
+    if(count>MAX_BUFFER/2) {
+        mbus_ctx_exception(ctx, 3);
+
+    } else if(ctx->regmap) {
+        if((code = mbus_regmap_check(ctx, addr, cnt, MBUS_REG_R))!=0) {
+            mbus_ctx_exception(ctx, code);
+        } else {
+            uint8_t i;
+            if(ctx->ops->read_begin)
+                ctx->ops->read_begin(ctx);
+            for(i=0; i<cnt; i++)
+                ctx->buf.b_p.mb_m.data[i] = mbus_regmap_read(ctx, addr+i);
+        }
+
+    } else
+        ctx->ops->read_holding(ctx, addr, cnt, ctx->buf.b_p.mb_m.data);
+
+    if(!(ctx->state&STATE_REPLY)) {
+        size_t i;
+        for(i=0; i<cnt; i++)
+            ctx->buf.b_p.mb_m.data[i] = htobe16(ctx->buf.b_p.mb_m.data[i]);
+
+        // no exception, send reply
+        // node, function are the same.
+        // CRC is computed as the reply is sent
+        ctx->buf.b_p.mb_m.count = 2*cnt;
+        ctx->buf_cnt = 5+2*cnt;
+        ctx->state |= STATE_TXCRC;
+    }
+}
+
+// Start streaming reply to function 3
+static void mbus_stream_reply(struct mbus_ctx *ctx, uint16_t addr, uint16_t count)
+{
+    uint8_t cnt = count;
+
+    if(count==0 || count>125) {
+        mbus_ctx_exception(ctx, 3);
+        return;
+    }
+
+    if(ctx->regmap) {
+        uint8_t code = mbus_regmap_check(ctx, addr, cnt, MBUS_REG_R);
+        if(code)
+            mbus_ctx_exception(ctx, code);
+        else if(ctx->ops->read_begin)
+            ctx->ops->read_begin(ctx);
+
+    } else if(ctx->ops->stream_begin)
+        ctx->ops->stream_begin(ctx, addr, cnt);
+
+    if(!(ctx->state&STATE_REPLY)) {
+        // node, function are the same.
+        // data and CRC are generated as the reply is sent
+        ctx->buf.b_p.mb_m.count = 2*cnt;
+        ctx->buf_cnt = 5+2*cnt;
+        ctx->stream_addr = addr;
+        ctx->state |= STATE_TXCRC|STATE_STREAM;
+    }
+}
 
-    } else if(buf.b_p.function==3) {
-        uint16_t count = be16toh(buf.b_p.mb_s.data);
-        uint8_t cnt = count; // valid counts will always be <256
+// Read coils or discrete inputs and build reply (functions 1 and 2)
+static void mbus_read_bits(struct mbus_ctx *ctx, uint16_t addr, uint16_t count)
+{
+    uint8_t nbytes, *bits = (uint8_t*)ctx->buf.b_p.mb_m.data;
+
+    if(count==0 || count>2000 || count>8*MAX_BUFFER) {
+        mbus_ctx_exception(ctx, 3);
+        return;
+    }
+
+    nbytes = (count+7)/8;
+    memset(bits, 0, nbytes);
+
+    if(ctx->buf.b_p.function==1)
+        ctx->ops->read_coils(ctx, addr, count, bits);
+    else
+        ctx->ops->read_discrete(ctx, addr, count, bits);
+
+    if(!(ctx->state&STATE_REPLY)) {
+        ctx->buf.b_p.mb_m.count = nbytes;
+        ctx->buf_cnt = 5+nbytes;
+        ctx->state |= STATE_TXCRC;
+    }
+}
+
+// convert received register values to host order in place
+static void mbus_swap_in(uint16_t *data, uint8_t cnt)
+{
+    uint8_t i;
+    for(i=0; i<cnt; i++)
+        data[i] = be16toh(data[i]);
+}
+
+// Diagnostics (function 8)
+static void mbus_diagnostic(struct mbus_ctx *ctx)
+{
+    struct mbus_counters *D = &ctx->diag;
+    uint16_t sub = be16toh(ctx->buf.b_p.mb_s.addr),
+             data = be16toh(ctx->buf.b_p.mb_s.data), *counter;
+
+    switch(sub) {
+    case 0x00: // return query data
+        counter = NULL;
+        break;
+    case 0x0A: // clear counters
+        if(data!=0)
+            mbus_ctx_exception(ctx, 3);
+        else
+            memset(D, 0, sizeof(*D));
+        counter = NULL;
+        break;
+    case 0x0B: counter = &D->bus_msg; break;
+    case 0x0C: counter = &D->bus_crc; break;
+    case 0x0D: counter = &D->bus_except; break;
+    case 0x0E: counter = &D->server_msg; break;
+    case 0x0F: counter = &D->no_resp; break;
+    case 0x12: counter = &D->overrun; break;
+    case 0x64: counter = &D->framing; break;
+    case 0x65: counter = &D->parity; break;
+    case 0x66: counter = &D->blackouts; break;
+    default:
+        mbus_ctx_exception(ctx, 1);
+        return;
+    }
+
+    if(counter && data!=0) {
+        mbus_ctx_exception(ctx, 3);
+
+    } else if(!(ctx->state&STATE_REPLY)) {
+        // reply echoes the sub-function, with the counter as data
+        if(counter)
+            ctx->buf.b_p.mb_s.data = htobe16(*counter);
+        ctx->buf_cnt = 8;
+        ctx->state |= STATE_TXCRC;
+    }
+}
+
+// Read FIFO queue and build reply (function 24)
+static void mbus_read_fifo_reply(struct mbus_ctx *ctx, uint16_t addr)
+{
+    uint16_t *data = ctx->buf.b_p.mb_f.data;
+    uint8_t cnt = ctx->ops->read_fifo(ctx, addr, MBUS_FIFO_MAX, data), i;
+
+    if(ctx->state&STATE_REPLY)
+        return;
+
+    if(cnt>MBUS_FIFO_MAX) {
+        mbus_ctx_exception(ctx, 3);
+        return;
+    }
+
+    for(i=0; i<cnt; i++)
+        data[i] = htobe16(data[i]);
+
+    ctx->buf.b_p.mb_f.bytes = htobe16(2+2*cnt);
+    ctx->buf.b_p.mb_f.count = htobe16(cnt);
+    ctx->buf_cnt = 8+2*cnt;
+    ctx->state |= STATE_TXCRC;
+}
+
+static void mbus_dispatch(struct mbus_ctx *ctx)
+{
+    // CRC over a message including its (correct) CRC is zero
+    if(ctx->crc_acc!=0) {
+        ctx->diag.bus_crc++;
+        mbus_ctx_exception(ctx, 4);
+
+    } else if(ctx->buf.b_p.function==8) {
+        mbus_diagnostic(ctx);
+
+    } else if(ctx->buf.b_p.function==24) {
+        mbus_read_fifo_reply(ctx, be16toh(ctx->buf.b_p.mb_s.addr));
+
+    } else if(ctx->buf.b_p.function==11) {
+        // comm event counter.  Status is never busy
+        ctx->buf.b_p.mb_s.addr = 0;
+        ctx->buf.b_p.mb_s.data = htobe16(ctx->diag.events);
+        ctx->buf_cnt = 8;
+        ctx->state |= STATE_TXCRC;
+
+    } else if(ctx->buf.b_p.function<=2) {
+        // read coils or discrete inputs
+        mbus_read_bits(ctx, be16toh(ctx->buf.b_p.mb_s.addr),
+                       be16toh(ctx->buf.b_p.mb_s.data));
+
+    } else if(ctx->buf.b_p.function==3 && (ctx->regmap || ctx->ops->stream_reg)) {
+        // register map reads are streamed
+        mbus_stream_reply(ctx, be16toh(ctx->buf.b_p.mb_s.addr),
+                          be16toh(ctx->buf.b_p.mb_s.data));
+
+    } else if(ctx->buf.b_p.function==3) {
         // read
-        if(count>MAX_BUFFER/2)
-            mbus_exception(3);
+        mbus_read_reply(ctx, be16toh(ctx->buf.b_p.mb_s.addr),
+                        be16toh(ctx->buf.b_p.mb_s.data));
+
+    } else if(ctx->buf.b_p.function==23) {
+        // write, then read
+        uint16_t raddr = be16toh(ctx->buf.b_p.mb_rw.raddr),
+                 rcount = be16toh(ctx->buf.b_p.mb_rw.rcount);
+        uint8_t cnt = ctx->buf.b_p.mb_rw.bytes/2; // validated in mbus_recieve(ctx)
+
+        mbus_swap_in(ctx->buf.b_p.mb_rw.data, cnt);
+
+        if(ctx->regmap)
+            mbus_regmap_write_multi(ctx, be16toh(ctx->buf.b_p.mb_rw.waddr),
+                                    cnt, ctx->buf.b_p.mb_rw.data);
         else
-            mbus_read_holding(be16toh(buf.b_p.mb_s.addr),
-                              cnt,
-                              buf.b_p.mb_m.data);
+            ctx->ops->write_holding_multi(ctx, be16toh(ctx->buf.b_p.mb_rw.waddr),
+                                     cnt,
+                                     ctx->buf.b_p.mb_rw.data);
 
-        {
-            size_t i;
-            for(i=0; i<cnt; i++)
-                buf.b_p.mb_m.data[i] = htobe16(buf.b_p.mb_m.data[i]);
+        // read is skipped if the write raised an exception
+        if(!(ctx->state&STATE_REPLY))
+            mbus_read_reply(ctx, raddr, rcount);
+
+    } else if(ctx->buf.b_p.function==16) {
+        uint8_t cnt = ctx->buf.b_p.mb_w.bytes/2; // validated in mbus_recieve(ctx)
+
+        mbus_swap_in(ctx->buf.b_p.mb_w.data, cnt);
+
+        if(ctx->regmap)
+            mbus_regmap_write_multi(ctx, be16toh(ctx->buf.b_p.mb_w.addr),
+                                    cnt, ctx->buf.b_p.mb_w.data);
+        else
+            ctx->ops->write_holding_multi(ctx, be16toh(ctx->buf.b_p.mb_w.addr),
+                                     cnt,
+                                     ctx->buf.b_p.mb_w.data);
+
+        if(!(ctx->state&STATE_REPLY)) {
+            // reply is the request header (addr and count)
+            ctx->buf_cnt = 8;
+            ctx->state |= STATE_TXCRC;
         }
+    } else if(ctx->buf.b_p.function==5) {
+        uint16_t value = be16toh(ctx->buf.b_p.mb_s.data);
+        uint8_t bit = value==0xff00;
 
-        if(!(mb_state&STATE_REPLY)) {
-            // no exception, send reply
-            // node, function are the same.
-            buf.b_p.mb_m.count = 2*cnt;
-            buf.b_p.mb_m.data[cnt] = htole16(calculate_crc(buf.b_b, 3+2*cnt));
-            buf_cnt = 5+2*cnt;
+        if(!bit && value!=0)
+            mbus_ctx_exception(ctx, 3);
+        else
+            ctx->ops->write_coils(ctx, be16toh(ctx->buf.b_p.mb_s.addr), 1, &bit);
+
+        // reply is to echo back request, or exception signaled by user
+
+    } else if(ctx->buf.b_p.function==15) {
+        ctx->ops->write_coils(ctx, be16toh(ctx->buf.b_p.mb_w.addr),
+                         be16toh(ctx->buf.b_p.mb_w.count),
+                         (const uint8_t*)ctx->buf.b_p.mb_w.data);
+
+        if(!(ctx->state&STATE_REPLY)) {
+            // reply is the request header (addr and count)
+            ctx->buf_cnt = 8;
+            ctx->state |= STATE_TXCRC;
         }
+
     } else { // function==6
         // write
-        mbus_write_holding(be16toh(buf.b_p.mb_s.addr),
-                           be16toh(buf.b_p.mb_s.data));
+        uint16_t value = be16toh(ctx->buf.b_p.mb_s.data);
+
+        if(ctx->regmap)
+            mbus_regmap_write_multi(ctx, be16toh(ctx->buf.b_p.mb_s.addr),
+                                    1, &value);
+        else
+            ctx->ops->write_holding(ctx, be16toh(ctx->buf.b_p.mb_s.addr),
+                               value);
 
         // reply is to echo back request, or exception signaled by user
     }
 
-    mb_state |= STATE_REPLY;
+    ctx->state |= STATE_REPLY;
 }
 
-static void mbus_recieve(void)
-{
-    // recving request
-    uint8_t next, sts;
+static void mbus_rx_byte(struct mbus_ctx *ctx, uint8_t next);
 
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        sts = mbus_status;
-        mbus_status = sts & ~MBUS_RX_READY;
-        next = mbus_in_byte;
+/* Skipping a frame, which may be a request or a reply.  The RX timeout
+ * isn't needed to find the end.  A frame ends where the CRC over
+ * all of its bytes is correct (the residue is zero).  Or it is
+ * the 4 byte LRC exception reply of another server, which isn't
+ * a valid CRC frame, so a fifth byte is the start of the next frame.
+ * The first byte of a skipped frame is stored, as are the next few.
+ */
+static void mbus_skip_byte(struct mbus_ctx *ctx, uint8_t next)
+{
+    uint8_t bpos = ctx->buf_pos, *b = ctx->buf.b_b;
+
+    if(bpos==4 && b[0] && (b[1]&0x80) && (uint8_t)(b[0]+b[1]+b[2]+b[3])==0 &&
+       crc16_update(ctx->crc_acc, next)!=0)
+    {
+        // previous frame was an LRC exception, this byte starts the next
+        mbus_ctx_rx_clear(ctx);
+        mbus_rx_byte(ctx, next);
+        return;
     }
 
-    if(!(sts&MBUS_RX_READY)) {
-        // RX timeout, reset buffer
-        mbus_rx_clear();
+    if(bpos<4)
+        b[bpos] = next;
+    ctx->crc_acc = crc16_update(ctx->crc_acc, next);
+    if(bpos!=0xff)
+        bpos++;
+    ctx->buf_pos = bpos;
+
+    if(bpos>=4 && ctx->crc_acc==0)
+        mbus_ctx_rx_clear(ctx); // end of frame
+}
+
+// handle one byte of a request
+static void mbus_rx_byte(struct mbus_ctx *ctx, uint8_t next)
+{
+    if(ctx->state&STATE_SKIP) {
+        mbus_skip_byte(ctx, next);
         return;
     }
 
-    uint8_t bpos = buf_pos;
+    uint8_t bpos = ctx->buf_pos, complete = 0;
+
+    if(bpos==0) {
+        ctx->diag.bus_msg++;
+
+        if(next!=ctx->unit && next!=0) {
+            // not for us, ignore the rest of this frame
+            ctx->state |= STATE_SKIP;
+            mbus_skip_byte(ctx, next);
+            return;
+        }
+    }
 
     // store byte
-    buf.b_b[bpos++] = next;
+    ctx->buf.b_b[bpos++] = next;
+    ctx->crc_acc = crc16_update(ctx->crc_acc, next);
 
-    if(bpos==buf_cnt) {
+    if(bpos==ctx->buf_cnt) {
         // complete message received
-        mbus_dispatch();
+        complete = 1;
+        mbus_dispatch(ctx);
 
     } else if(bpos==2) {
         // early check of function code
-        if(buf.b_p.function!=3 && buf.b_p.function!=6) {
-            mbus_exception(1); // illegal function
+        // and that the user program handles it
+        const struct mbus_ops *ops = ctx->ops;
+        uint8_t func = ctx->buf.b_p.function, ok;
+
+        switch(func) {
+        case 1: ok = !!ops->read_coils; break;
+        case 2: ok = !!ops->read_discrete; break;
+        case 3: ok = ctx->regmap || ops->read_holding || ops->stream_reg; break;
+        case 5:
+        case 15: ok = !!ops->write_coils; break;
+        case 6: ok = ctx->regmap || ops->write_holding; break;
+        case 16: ok = ctx->regmap || ops->write_holding_multi; break;
+        case 23: ok = ctx->regmap || (ops->read_holding && ops->write_holding_multi); break;
+        case 24: ok = !!ops->read_fifo; break;
+        case 8:
+        case 11: ok = 1; break;
+        default: ok = 0;
         }
+
+        if(!ok) {
+            mbus_ctx_exception(ctx, 1); // illegal function
+
+        } else if(!ctx->buf.b_p.node && (func<=3 || func==23 || func==24 || func==8 || func==11)) {
+            // broadcast is only allowed for writes
+            ctx->state |= STATE_SKIP;
+            ctx->buf_pos = bpos;
+            return;
+
+        } else if(func==23) {
+            ctx->buf_cnt = 13; // at least until the byte count is known
+
+        } else if(func==11) {
+            // complete request is node, function, and CRC
+            ctx->buf_cnt = 4;
+
+        } else if(func==24) {
+            // FIFO address, and CRC
+            ctx->buf_cnt = 6;
+        }
+
+    } else if(bpos==7 && ctx->buf.b_p.function==16) {
+        // byte count received, now the request length is known
+        uint16_t count = be16toh(ctx->buf.b_p.mb_w.count);
+        uint8_t nbytes = ctx->buf.b_p.mb_w.bytes;
+
+        if(count==0 || count>MAX_BUFFER/2 || count>123 || nbytes!=2*count)
+            mbus_ctx_exception(ctx, 3);
+        else
+            ctx->buf_cnt = 9+nbytes;
+
+    } else if(bpos==7 && ctx->buf.b_p.function==15) {
+        uint16_t count = be16toh(ctx->buf.b_p.mb_w.count);
+        uint8_t nbytes = ctx->buf.b_p.mb_w.bytes;
+
+        if(count==0 || count>1968 || nbytes>MAX_BUFFER || nbytes!=(count+7)/8)
+            mbus_ctx_exception(ctx, 3);
+        else
+            ctx->buf_cnt = 9+nbytes;
+
+    } else if(bpos==11 && ctx->buf.b_p.function==23) {
+        uint16_t rcount = be16toh(ctx->buf.b_p.mb_rw.rcount),
+                 wcount = be16toh(ctx->buf.b_p.mb_rw.wcount);
+        uint8_t nbytes = ctx->buf.b_p.mb_rw.bytes;
+
+        if(rcount==0 || rcount>MAX_BUFFER/2 || rcount>125 ||
+           wcount==0 || wcount>MAX_BUFFER/2 || wcount>121 ||
+           nbytes!=2*wcount)
+            mbus_ctx_exception(ctx, 3);
+        else
+            ctx->buf_cnt = 13+nbytes;
     }
 
-    if(mb_state&STATE_REPLY) {
-        buf_pos = 1;
+    if(ctx->state&STATE_REPLY) {
+        uint8_t func = ctx->buf.b_p.function;
+
+        ctx->diag.server_msg++;
+        if(func&0x80)
+            ctx->diag.bus_except += !!ctx->buf.b_p.node;
+        else if(func!=11)
+            ctx->diag.events++;
+    }
+
+    if(ctx->state&STATE_REPLY && !ctx->buf.b_p.node) {
+        // broadcast, never reply.
+        ctx->diag.no_resp++;
+        ctx->state &= ~(STATE_REPLY|STATE_TXCRC|STATE_STREAM);
+        if(complete) {
+            mbus_ctx_rx_clear(ctx);
+        } else {
+            // early exception, ignore remainder.  crc_acc is still over the request
+            ctx->state |= STATE_SKIP;
+            ctx->buf_pos = bpos;
+        }
+    } else if(ctx->state&STATE_REPLY) {
+        ctx->buf_pos = 1;
+        ctx->crc_acc = crc16_update(0xffff, ctx->buf.b_b[0]);
         ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-            mbus_status |= MBUS_TX_READY;
-            mbus_out_byte = buf.b_b[0];
+            ctx->status |= MBUS_TX_READY;
+            ctx->out_byte = ctx->buf.b_b[0];
         }
     }else
-        buf_pos = bpos;
+        ctx->buf_pos = bpos;
 }
 
-static void mbus_transmit(void)
+static void mbus_recieve(struct mbus_ctx *ctx)
 {
-    uint8_t sts, bpos = buf_pos, next=buf.b_b[bpos];
+    // recving request
+    uint8_t next, sts;
 
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        sts = mbus_status;
-        if(!(sts&MBUS_TX_READY)) {
-            mbus_status = sts|MBUS_TX_READY;
-            mbus_out_byte = next;
-        }
+        sts = ctx->status;
+        ctx->status = sts & ~MBUS_RX_READY;
+        next = ctx->in_byte;
     }
 
-    if(!(sts&MBUS_TX_READY)) {
-        bpos++;
-        buf_pos=bpos;
+    if(!(sts&MBUS_RX_READY)) {
+        // RX timeout, reset buffer
+        mbus_ctx_rx_clear(ctx);
+        return;
+    }
+
+    mbus_rx_byte(ctx, next);
+}
+
+// next byte of a streaming reply.  Header is in the buffer.
+static uint8_t mbus_stream_byte(struct mbus_ctx *ctx, uint8_t bpos)
+{
+    if(bpos<3) {
+        return ctx->buf.b_b[bpos];
+
+    } else if(bpos==ctx->buf_cnt-2) {
+        // CRC isn't stored, the buffer may be too short
+        ctx->stream_val = ctx->crc_acc;
+        return ctx->stream_val;
+
+    } else if(bpos==ctx->buf_cnt-1) {
+        return ctx->stream_val>>8;
+
+    } else if(!((bpos-3)&1)) {
+        // big endian.  high byte first
+        uint16_t addr = ctx->stream_addr++;
+        if(ctx->regmap)
+            ctx->stream_val = mbus_regmap_read(ctx, addr);
+        else
+            ctx->stream_val = ctx->ops->stream_reg(ctx, addr);
+        return ctx->stream_val>>8;
+
+    } else {
+        return ctx->stream_val;
+    }
+}
+
+// next byte of the reply
+static uint8_t mbus_tx_byte(struct mbus_ctx *ctx)
+{
+    uint8_t bpos = ctx->buf_pos, next;
+
+    if(ctx->state&STATE_STREAM) {
+        next = mbus_stream_byte(ctx, bpos);
+
+    } else {
+        if(ctx->state&STATE_TXCRC && bpos==ctx->buf_cnt-2) {
+            uint16_t crc = ctx->crc_acc;
+            ctx->buf.b_b[bpos] = crc;
+            ctx->buf.b_b[bpos+1] = crc>>8;
+        }
+        next = ctx->buf.b_b[bpos];
     }
 
-    if(buf_pos==buf_cnt) {
+    ctx->buf_pos = ++bpos;
+    if(ctx->state&STATE_TXCRC)
+        ctx->crc_acc = crc16_update(ctx->crc_acc, next);
+
+    if(bpos==ctx->buf_cnt) {
         // done with send. setup for next recv
-        mb_state &= ~STATE_REPLY;
-        buf_pos = 0;
-        buf_cnt = 8;
+        ctx->state &= ~(STATE_REPLY|STATE_TXCRC|STATE_STREAM);
+        mbus_ctx_rx_clear(ctx);
     }
+    return next;
 }
 
-void mbus_process(void)
+static void mbus_transmit(struct mbus_ctx *ctx)
 {
-    if(mb_state&STATE_REPLY)
-        mbus_transmit();
+    uint8_t next;
+
+    // only the user clears TX_READY
+    if(ctx->status&MBUS_TX_READY)
+        return;
+
+    next = mbus_tx_byte(ctx);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ctx->out_byte = next;
+        ctx->status |= MBUS_TX_READY;
+    }
+}
+
+void mbus_ctx_process(struct mbus_ctx *ctx)
+{
+    if(ctx->state&STATE_REPLY)
+        mbus_transmit(ctx);
     else
-        mbus_recieve();
+        mbus_recieve(ctx);
+}
+
+uint8_t mbus_ctx_feed(struct mbus_ctx *ctx, const uint8_t *buf, uint8_t n)
+{
+    uint8_t i;
+
+    // stop when a reply is ready
+    for(i=0; i<n && !(ctx->state&STATE_REPLY); i++)
+        mbus_rx_byte(ctx, buf[i]);
+    return i;
+}
+
+uint8_t mbus_ctx_drain(struct mbus_ctx *ctx, uint8_t *buf, uint8_t max)
+{
+    uint8_t n = 0;
+
+    if(!max)
+        return 0;
+
+    if(ctx->status&MBUS_TX_READY) {
+        // first byte was already made ready
+        buf[n++] = ctx->out_byte;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            ctx->status &= ~MBUS_TX_READY;
+        }
+    }
+
+    while(n<max && ctx->state&STATE_REPLY)
+        buf[n++] = mbus_tx_byte(ctx);
+
+    // leave the next byte ready, as mbus_ctx_process() would
+    if(ctx->state&STATE_REPLY)
+        mbus_transmit(ctx);
+
+    return n;
+}
+
+/* Single instance API.
+ * The default context calls the global user hooks.
+ */
+
+static void def_read_holding(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, uint16_t * restrict result)
+{
+    mbus_read_holding(addr, count, result);
+}
+
+static void def_write_holding(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
+{
+    mbus_write_holding(addr, value);
+}
+
+static void def_write_holding_multi(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, const uint16_t * restrict value)
+{
+    mbus_write_holding_multi(addr, count, value);
+}
+
+static void def_read_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    mbus_read_coils(addr, count, result);
+}
+
+static void def_read_discrete(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    mbus_read_discrete(addr, count, result);
+}
+
+static void def_write_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, const uint8_t * restrict value)
+{
+    mbus_write_coils(addr, count, value);
+}
+
+static uint8_t def_read_fifo(struct mbus_ctx *ctx, uint16_t addr, uint8_t max, uint16_t * restrict result)
+{
+    return mbus_read_fifo(addr, max, result);
+}
+
+static void def_read_begin(struct mbus_ctx *ctx)
+{
+    mbus_read_begin();
+}
+
+static const struct mbus_ops mbus_default_ops = {
+    .read_holding = def_read_holding,
+    .write_holding = def_write_holding,
+    .write_holding_multi = def_write_holding_multi,
+    .read_coils = def_read_coils,
+    .read_discrete = def_read_discrete,
+    .write_coils = def_write_coils,
+    .read_fifo = def_read_fifo,
+    .read_begin = def_read_begin,
+};
+
+struct mbus_ctx mbus_default = {
+    .ops = &mbus_default_ops,
+    .unit = 1,
+    .buf_cnt = 8,
+    .crc_acc = 0xffff,
+};
+
+void mbus_reset(void)
+{
+    mbus_ctx_reset(&mbus_default);
+}
+
+void mbus_rx_clear(void)
+{
+    mbus_ctx_rx_clear(&mbus_default);
+}
+
+void mbus_set_unit(uint8_t unit)
+{
+    mbus_ctx_set_unit(&mbus_default, unit);
+}
+
+uint8_t mbus_get_unit(void)
+{
+    return mbus_ctx_get_unit(&mbus_default);
+}
+
+void mbus_exception(uint8_t code)
+{
+    mbus_ctx_exception(&mbus_default, code);
+}
+
+void mbus_set_regmap(const struct mbus_reg *map, uint16_t nregs)
+{
+    mbus_ctx_set_regmap(&mbus_default, map, nregs);
+}
+
+uint8_t mbus_write_reg(uint16_t addr, uint16_t value)
+{
+    return mbus_ctx_write_reg(&mbus_default, addr, value);
+}
+
+void mbus_process(void)
+{
+    mbus_ctx_process(&mbus_default);
+}
+
+uint8_t mbus_feed(const uint8_t *buf, uint8_t n)
+{
+    return mbus_ctx_feed(&mbus_default, buf, n);
+}
+
+uint8_t mbus_drain(uint8_t *buf, uint8_t max)
+{
+    return mbus_ctx_drain(&mbus_default, buf, max);
 }
@@ -24,19 +24,281 @@
 
 #include <inttypes.h>
 
+#include "crc16.h"
+
 #ifndef __AVR__
 #  define ATOMIC_BLOCK(X)
 #  define ATOMIC_RESTORESTATE
+#  define MBUS_REGMAP
 #else
 #  include <util/atomic.h>
+#  include <avr/pgmspace.h>
+//! Register map tables are kept in flash
+#  define MBUS_REGMAP PROGMEM
 #endif
 
+/* Bytes of register/coil data in a single request or reply.
+ * Reads of up to MAX_BUFFER/2 registers are allowed.
+ *
+ * 250 allows the full size RTU ADU (256 bytes), which is
+ * 125 registers for function 3.  The largest frame of any supported
+ * function is then 255 bytes.
+ *
+ * Set per target in the Makefile with <target>_MAX_BUFFER
+ */
 #ifndef MAX_BUFFER
 #  define MAX_BUFFER 20
 #endif
 
-extern volatile uint8_t mbus_in_byte;
-extern volatile uint8_t mbus_out_byte;
+#if MAX_BUFFER>250
+#  error MAX_BUFFER must be <=250 (full size RTU ADU)
+#endif
+
+/* Modbus RTU frame layouts.  Multi-byte fields are big endian,
+ * except for the CRC which is little endian.
+ */
+struct mbus_single_reg {
+    uint16_t addr;
+    uint16_t data;
+    uint16_t crc;
+};
+
+struct mbus_multi_reply {
+    uint8_t count;
+    uint16_t data[1+MAX_BUFFER/2]; // extra entry for crc
+} __attribute__((packed));
+
+struct mbus_multi_write {
+    uint16_t addr;
+    uint16_t count;
+    uint8_t bytes;
+    uint16_t data[1+MAX_BUFFER/2]; // extra entry for crc
+} __attribute__((packed));
+
+struct mbus_read_write {
+    uint16_t raddr;
+    uint16_t rcount;
+    uint16_t waddr;
+    uint16_t wcount;
+    uint8_t bytes;
+    uint16_t data[1+MAX_BUFFER/2]; // extra entry for crc
+} __attribute__((packed));
+
+/* Read FIFO queue (function 24) returns at most 31 registers,
+ * and is also limited by MAX_BUFFER.
+ */
+#if MAX_BUFFER/2 < 31
+#  define MBUS_FIFO_MAX (MAX_BUFFER/2)
+#else
+#  define MBUS_FIFO_MAX 31
+#endif
+
+struct mbus_fifo_reply {
+    uint16_t bytes;
+    uint16_t count;
+    uint16_t data[1+MBUS_FIFO_MAX]; // extra entry for crc
+} __attribute__((packed));
+
+struct mbus_except {
+    uint8_t code;
+    uint8_t lrc;
+};
+
+//! A complete frame
+struct mbus_message {
+    uint8_t node;
+    uint8_t function;
+    union {
+        struct mbus_single_reg mb_s;
+        struct mbus_multi_reply mb_m;
+        struct mbus_multi_write mb_w;
+        struct mbus_read_write mb_rw;
+        struct mbus_fifo_reply mb_f;
+        struct mbus_except mb_e;
+    };
+};
+
+struct mbus_ctx;
+
+/* User hooks of a server instance.  Arguments as for the global
+ * hooks below, with the addition of the calling context.
+ * Functions with a NULL hook are answered with exception 1.
+ */
+struct mbus_ops {
+    void (*read_holding)(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, uint16_t * restrict result);
+    void (*write_holding)(struct mbus_ctx *ctx, uint16_t addr, uint16_t value);
+    void (*write_holding_multi)(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, const uint16_t * restrict value);
+    void (*read_coils)(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result);
+    void (*read_discrete)(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result);
+    void (*write_coils)(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, const uint8_t * restrict value);
+    uint8_t (*read_fifo)(struct mbus_ctx *ctx, uint16_t addr, uint8_t max, uint16_t * restrict result);
+
+    /* Streaming function 3 replies (optional).
+     *
+     * When stream_reg is set, function 3 doesn't use read_holding.
+     * The reply is sent as it is generated.  stream_reg is called for
+     * each register just before its first byte is sent.  The CRC is
+     * computed as bytes are sent.  So the time to the first reply byte
+     * doesn't depend on the register count.  Reads of up to 125
+     * registers are allowed, whatever MAX_BUFFER is.
+     *
+     * stream_begin, if set, is called first with the whole range.
+     * It may call mbus_ctx_exception().  No exception is possible
+     * once the reply has started.
+     */
+    void (*stream_begin)(struct mbus_ctx *ctx, uint16_t addr, uint8_t count);
+    uint16_t (*stream_reg)(struct mbus_ctx *ctx, uint16_t addr);
+
+    /* With a register map (optional).  Called once for each function 3
+     * or 23 read, after the range is checked and before any register
+     * is fetched.  Eg. to take a consistent copy of values which
+     * an ISR updates.
+     */
+    void (*read_begin)(struct mbus_ctx *ctx);
+};
+
+/* Declarative register map.
+ *
+ * One entry per holding register, indexed by address, so lookup
+ * doesn't depend on the table size.  Declare tables as
+ *
+ *   static const struct mbus_reg regs[N] MBUS_REGMAP = {...};
+ *
+ * Reads (functions 3 and 23) call read() if set, otherwise copy *store.
+ * Plain storage reads go straight into the reply without calling
+ * any user code.
+ *
+ * Writes (functions 6, 16, and 23) first clear any bits not in wmask.
+ * Then call write() if set, which is responsible for storing
+ * the value and may call mbus_ctx_exception().  Otherwise only the
+ * bits in wmask of *store are changed.
+ *
+ * Access to a register outside the table, or with neither flag,
+ * and reads of a register without MBUS_REG_R, are rejected with
+ * exception 2 before any register of the request is read or written.
+ * Writes to a register without MBUS_REG_W are ignored, as if wmask
+ * were 0.  So a master may write a block which spans read only
+ * registers.
+ *
+ * When a map is set, it replaces the holding register hooks
+ * of struct mbus_ops.
+ */
+#define MBUS_REG_R  0x01
+#define MBUS_REG_W  0x02
+#define MBUS_REG_RW (MBUS_REG_R|MBUS_REG_W)
+
+struct mbus_reg {
+    uint16_t *store;
+    uint16_t (*read)(struct mbus_ctx *ctx, uint16_t addr);
+    void (*write)(struct mbus_ctx *ctx, uint16_t addr, uint16_t value);
+    uint16_t wmask;
+    uint8_t flags;
+};
+
+/* Diagnostic counters of one port.
+ *
+ * Read with function 8 (diagnostics) using the sub-function noted,
+ * and cleared with sub-function 0x0A.  All count modulo 2^16.
+ * Sub-functions 0x64 and up are specific to this server.
+ *
+ * The engine maintains the counters of requests and replies.
+ * The UART errors and blackouts are counted by the program driving
+ * the port, which may add to them directly from the main loop.
+ */
+struct mbus_counters {
+    uint16_t bus_msg;    //!< 0x0B Frames seen on the bus, for any unit
+    uint16_t bus_crc;    //!< 0x0C Frames for this unit with a bad CRC
+    uint16_t bus_except; //!< 0x0D Exception replies sent
+    uint16_t server_msg; //!< 0x0E Requests for this unit, or broadcast
+    uint16_t no_resp;    //!< 0x0F Requests not answered (broadcast)
+    uint16_t overrun;    //!< 0x12 Characters lost.  UART overrun or buffer full
+    uint16_t framing;    //!< 0x64 UART framing errors
+    uint16_t parity;     //!< 0x65 UART parity errors
+    uint16_t blackouts;  //!< 0x66 Times input was ignored after an error
+    //! Function 11.  Requests completed without exception, except function 11
+    uint16_t events;
+};
+
+/** State of one Modbus server instance (port).
+ *
+ * in_byte, out_byte, and status are used as
+ * mbus_in_byte, mbus_out_byte, and mbus_status are
+ * for the single instance API.
+ */
+struct mbus_ctx {
+    volatile uint8_t in_byte;
+    volatile uint8_t out_byte;
+    volatile uint8_t status;
+
+    uint8_t state;
+    uint8_t unit;
+    uint8_t buf_cnt, buf_pos;
+    /* Running CRC.  While receiving, over all bytes received so far.
+     * While replying, over all bytes sent so far.
+     */
+    uint16_t crc_acc;
+
+    //! Streaming reply.  Address of next register, and value being sent.
+    uint16_t stream_addr, stream_val;
+
+    const struct mbus_ops *ops;
+    //! Optional register map.  See mbus_ctx_set_regmap()
+    const struct mbus_reg *regmap;
+    uint16_t nregs;
+    //! For use by user hooks
+    void *user;
+
+    struct mbus_counters diag;
+
+    union {
+        struct mbus_message b_p;
+        uint8_t b_b[sizeof(struct mbus_message)];
+    } buf;
+};
+
+/** @brief Initialize a server instance
+ *
+ * Unit address is 1.
+ */
+void mbus_ctx_init(struct mbus_ctx *ctx, const struct mbus_ops *ops, void *user);
+
+// Per instance versions of the functions below
+void mbus_ctx_reset(struct mbus_ctx *ctx);
+void mbus_ctx_rx_clear(struct mbus_ctx *ctx);
+void mbus_ctx_set_unit(struct mbus_ctx *ctx, uint8_t unit);
+uint8_t mbus_ctx_get_unit(const struct mbus_ctx *ctx);
+void mbus_ctx_process(struct mbus_ctx *ctx);
+uint8_t mbus_ctx_feed(struct mbus_ctx *ctx, const uint8_t *buf, uint8_t n);
+uint8_t mbus_ctx_drain(struct mbus_ctx *ctx, uint8_t *buf, uint8_t max);
+//! Call from a user hook to reject the request being processed
+void mbus_ctx_exception(struct mbus_ctx *ctx, uint8_t code);
+
+/** @brief Serve holding registers from a register map
+ *
+ * map[] has nregs entries, for addresses 0 through nregs-1.
+ * Pass NULL to return to the holding register hooks.
+ */
+void mbus_ctx_set_regmap(struct mbus_ctx *ctx, const struct mbus_reg *map, uint16_t nregs);
+
+/** @brief Write one register through the map, as for function 6
+ *
+ * For use outside of request processing (eg. restoring saved settings).
+ * Returns 0 on success, or the exception code.  Call mbus_ctx_reset()
+ * before serving requests if a write handler may raise an exception.
+ */
+uint8_t mbus_ctx_write_reg(struct mbus_ctx *ctx, uint16_t addr, uint16_t value);
+
+/* Single instance API.
+ *
+ * Operates on mbus_default, which calls the global user hooks.
+ * A program may instead point mbus_default.ops at its own
+ * struct mbus_ops (eg. to use streaming replies) before
+ * interrupts are enabled.
+ */
+extern struct mbus_ctx mbus_default;
+
+#define mbus_in_byte (mbus_default.in_byte)
+#define mbus_out_byte (mbus_default.out_byte)
 
 //! Set by the mbus_process when mbus_out_byte has
 //! data to be sent.  User code should clear after
@@ -49,15 +311,28 @@ extern volatile uint8_t mbus_out_byte;
 //! detected.  User program should ignore received
 //! data for ~1 second.
 #define MBUS_RX_ERROR 0x04
-extern volatile uint8_t mbus_status;
+#define mbus_status (mbus_default.status)
+#define mbus_diag (mbus_default.diag)
 
 /** @brief Reset modbus server internal state
- * Return to startup state
+ * Return to startup state.  Diagnostic counters are cleared.
  */
 void mbus_reset(void);
 
 void mbus_rx_clear(void);
 
+/** @brief Set the unit (slave) address of this server
+ *
+ * Valid addresses are 1 through 247.  The default is 1.
+ * Frames for other units are ignored until they end, found from
+ * their CRC, or until the next RX timeout.
+ * Requests to address 0 (broadcast) are accepted for write functions,
+ * but never answered.  Not changed by mbus_reset().
+ */
+void mbus_set_unit(uint8_t unit);
+
+uint8_t mbus_get_unit(void);
+
 /** @brief Process modbus data
  * Call periodically complete processing
  * of received modbus requests.
@@ -70,14 +345,78 @@ void mbus_rx_clear(void);
  */
 void mbus_process(void);
 
+/** @brief Process several received bytes
+ *
+ * Same as setting mbus_in_byte and MBUS_RX_READY, then calling
+ * mbus_process(), for each byte in turn.  Stops early when a reply
+ * is ready (MBUS_TX_READY), which must be drained before feeding
+ * the remaining bytes.  Returns the number of bytes used.
+ *
+ * An RX timeout is still signaled by calling mbus_process()
+ * without MBUS_RX_READY.
+ */
+uint8_t mbus_feed(const uint8_t *buf, uint8_t n);
+
+/** @brief Take up to max bytes of reply
+ *
+ * Same as reading mbus_out_byte, clearing MBUS_TX_READY, and calling
+ * mbus_process(), while MBUS_TX_READY is set.  Returns the number
+ * of bytes stored.  If more remain, the next is left in mbus_out_byte
+ * with MBUS_TX_READY set, so the two APIs may be mixed.
+ */
+uint8_t mbus_drain(uint8_t *buf, uint8_t max);
+
 void mbus_exception(uint8_t code);
 
+void mbus_set_regmap(const struct mbus_reg *map, uint16_t nregs);
+
+uint8_t mbus_write_reg(uint16_t addr, uint16_t value);
+
 // User program must implement these functions
 
 void mbus_read_holding(uint16_t addr, uint8_t count, uint16_t * restrict result);
 
 void mbus_write_holding(uint16_t addr, uint16_t value);
 
-uint16_t calculate_crc(const uint8_t* d, uint8_t c);
+/** @brief Write several consecutive holding registers (function 16)
+ *
+ * value[] is in host byte order.  Call mbus_exception() to reject
+ * the request.  The default implementation (stubs.c) calls
+ * mbus_write_holding() for each register in turn, and stops after
+ * the first exception.
+ */
+void mbus_write_holding_multi(uint16_t addr, uint8_t count, const uint16_t * restrict value);
+
+/* Coils and discrete inputs (functions 1, 2, 5, and 15)
+ *
+ * Bits are packed LSB first, eight per byte.  result[] is zeroed
+ * before the read hooks are called.  Function 5 (write single coil)
+ * is passed to mbus_write_coils() with count==1.
+ *
+ * The default implementations (stubs.c) signal exception 1.
+ */
+void mbus_read_coils(uint16_t addr, uint16_t count, uint8_t * restrict result);
+
+void mbus_read_discrete(uint16_t addr, uint16_t count, uint8_t * restrict result);
+
+void mbus_write_coils(uint16_t addr, uint16_t count, const uint8_t * restrict value);
+
+/** @brief Read FIFO queue (function 24)
+ *
+ * Store up to max registers from the queue at addr in result[],
+ * in host byte order, and return the number stored.  max is
+ * MBUS_FIFO_MAX.  Whether the registers are then removed from
+ * the queue is up to the user program.
+ *
+ * The default implementation (stubs.c) signals exception 1.
+ */
+uint8_t mbus_read_fifo(uint16_t addr, uint8_t max, uint16_t * restrict result);
+
+/** @brief Start of a register map read
+ *
+ * As mbus_ops::read_begin.  The default implementation (stubs.c)
+ * does nothing.
+ */
+void mbus_read_begin(void);
 
 #endif // MBUS_H
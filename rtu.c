@@ -0,0 +1,282 @@
+/** Modbus RTU framing helpers for host programs
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "crc16.h"
+#include "rtu.h"
+
+static speed_t rtu_speed(unsigned baud)
+{
+    switch(baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default: return 0;
+    }
+}
+
+int rtu_open(const char *path, unsigned baud)
+{
+    struct termios tio;
+    speed_t speed = rtu_speed(baud);
+    int fd;
+
+    if(!speed) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = open(path, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+    if(fd<0)
+        return -1;
+
+    if(tcgetattr(fd, &tio)) {
+        close(fd);
+        return -1;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag &= ~(CSTOPB|PARENB|CRTSCTS);
+    tio.c_cflag |= CS8|CLOCAL|CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if(tcsetattr(fd, TCSANOW, &tio)) {
+        close(fd);
+        return -1;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+unsigned rtu_gap_us(unsigned baud)
+{
+    if(baud==0 || baud>19200)
+        return 1750;
+    return (35*11*1000000ul/10 + baud-1)/baud;
+}
+
+size_t rtu_add_crc(uint8_t *frame, size_t n)
+{
+    uint16_t crc = calculate_crc(frame, n);
+    frame[n] = crc;
+    frame[n+1] = crc>>8;
+    return n+2;
+}
+
+// sum of bytes, including the LRC, is zero
+static int rtu_lrc_ok(const uint8_t *frame, size_t n)
+{
+    uint8_t sum = 0;
+    while(n--)
+        sum += *frame++;
+    return sum==0;
+}
+
+int rtu_reply_len(const uint8_t *frame, size_t n)
+{
+    if(n<2)
+        return 0;
+
+    if(frame[1]&0x80) {
+        /* exception.  Standard 5 bytes with CRC, or 4 with LRC from mbus.c.
+         * The LRC of a standard exception matches 1 time in 256,
+         * so the CRC form is preferred when the fifth byte is here.
+         */
+        if(n<4)
+            return 0;
+        else if(n>=5 && calculate_crc(frame, 5)==0)
+            return 5;
+        else if(rtu_lrc_ok(frame, 4))
+            return 4;
+        else
+            return 5;
+    }
+
+    switch(frame[1]) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 23:
+        // byte count
+        if(n<3)
+            return 0;
+        return 5+frame[2];
+    case 5:
+    case 6:
+    case 8:
+    case 15:
+    case 16:
+        // echo of request header
+        return 8;
+    case 11:
+        // status and event count
+        return 8;
+    case 24:
+        // two byte count
+        if(n<4)
+            return 0;
+        return 6+(frame[2]<<8 | frame[3]);
+    default:
+        return -1;
+    }
+}
+
+int rtu_request_len(const uint8_t *frame, size_t n)
+{
+    if(n<2)
+        return 0;
+
+    switch(frame[1]) {
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+    case 8:
+        return 8;
+    case 11:
+        return 4;
+    case 24:
+        return 6;
+    case 15:
+    case 16:
+        if(n<7)
+            return 0;
+        return 9+frame[6];
+    case 23:
+        if(n<11)
+            return 0;
+        return 13+frame[10];
+    default:
+        return -1;
+    }
+}
+
+int rtu_check(const uint8_t *frame, size_t n)
+{
+    uint16_t crc = 0xffff;
+
+    if(n==4 && (frame[1]&0x80))
+        return !rtu_lrc_ok(frame, n);
+    else if(n<4)
+        return -1;
+
+    // calculate_crc() is limited to 255 bytes
+    while(n--)
+        crc = crc16_update(crc, *frame++);
+    return crc!=0;
+}
+
+static int64_t rtu_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000ll + ts.tv_nsec/1000000;
+}
+
+int rtu_transact(int fd, unsigned baud,
+                 const uint8_t *frame, size_t n,
+                 uint8_t *reply, size_t rmax,
+                 unsigned timeout_ms)
+{
+    int64_t deadline;
+    size_t pos = 0;
+    int err = 0, len = 0;
+
+    tcflush(fd, TCIFLUSH);
+
+    while(pos<n) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        ssize_t ret = write(fd, frame+pos, n-pos);
+        if(ret>=0)
+            pos += ret;
+        else if(errno==EAGAIN)
+            poll(&pfd, 1, 100);
+        else if(errno!=EINTR)
+            return -1;
+    }
+
+    if(frame[0]==0) {
+        // broadcast, no reply
+        usleep(rtu_gap_us(baud));
+        return 0;
+    }
+
+    // timeout from end of transmission
+    deadline = rtu_now_ms() + timeout_ms + n*11000ull/baud;
+    pos = 0;
+
+    while(1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int64_t remain = deadline-rtu_now_ms();
+        ssize_t ret;
+
+        if(remain<=0) {
+            err = ETIMEDOUT;
+            break;
+        }
+
+        ret = poll(&pfd, 1, remain);
+        if(ret<0 && errno!=EINTR)
+            return -1;
+        else if(ret<=0)
+            continue;
+
+        ret = read(fd, reply+pos, rmax-pos);
+        if(ret<0 && (errno==EINTR || errno==EAGAIN))
+            continue;
+        else if(ret<=0)
+            return -1;
+        pos += ret;
+
+        len = rtu_reply_len(reply, pos);
+        if(len<0 || (len>0 && (size_t)len<pos) || (len==0 && pos==rmax) || (size_t)len>rmax) {
+            err = EBADMSG;
+            break;
+        } else if(len>0 && (size_t)len==pos) {
+            if(rtu_check(reply, len) || reply[0]!=frame[0] || (reply[1]&0x7f)!=frame[1])
+                err = EBADMSG;
+            break;
+        }
+    }
+
+    usleep(rtu_gap_us(baud));
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return len;
+}
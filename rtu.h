@@ -0,0 +1,96 @@
+/** Modbus RTU framing helpers for host programs
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef RTU_H
+#define RTU_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Common code for host programs which talk Modbus RTU
+ * over a serial port (or pty).
+ *
+ * Frames use the layouts of mbus.h.  Exceptions are accepted
+ * both in the standard form (5 bytes with CRC) and in the
+ * 4 byte form with LRC sent by mbus.c.
+ */
+
+//! Largest RTU frame (ADU)
+#define RTU_MAX_FRAME 256
+
+/** @brief Open and configure a serial port
+ *
+ * Raw 8N1 at the given baud rate.  Non-blocking.
+ * A pty may also be given, in which case baud is ignored.
+ * Returns a file descriptor, or -1 with errno set.
+ */
+int rtu_open(const char *path, unsigned baud);
+
+/** @brief Minimum inter-frame gap (t3.5) in microseconds
+ *
+ * 3.5 characters of 11 bits, or 1750us above 19200 baud.
+ */
+unsigned rtu_gap_us(unsigned baud);
+
+//! Append CRC to frame of n bytes.  Returns new length (n+2)
+size_t rtu_add_crc(uint8_t *frame, size_t n);
+
+/** @brief Length of a reply frame
+ *
+ * Given the first n bytes of a reply, find the length
+ * of the complete frame.
+ *
+ * Returns the length, 0 if more bytes are needed,
+ * or -1 if the frame can't be understood.
+ *
+ * An exception is taken as the 4 byte LRC form only if its fifth
+ * byte doesn't complete a standard (CRC) exception, or hasn't
+ * arrived yet.  In that case a late fifth byte is left over,
+ * and is ignored as input between frames.
+ */
+int rtu_reply_len(const uint8_t *frame, size_t n);
+
+/** @brief Length of a request frame
+ *
+ * As rtu_reply_len() for a request.
+ */
+int rtu_request_len(const uint8_t *frame, size_t n);
+
+/** @brief Check CRC (or LRC) of a complete frame
+ *
+ * Returns 0 if valid.
+ */
+int rtu_check(const uint8_t *frame, size_t n);
+
+/** @brief Send a request and wait for the reply
+ *
+ * Blocking.  frame is a complete request, including CRC.
+ * Any stale input is discarded first.
+ * Waits for the inter-frame gap after the reply (or timeout)
+ * so that the next request may be sent immediately.
+ *
+ * Returns the length of a valid reply, which has the same unit
+ * and function (or exception) as the request.
+ * Returns -1 with errno ETIMEDOUT if no reply, EBADMSG if the
+ * reply is invalid, or some other error.  Broadcasts return 0.
+ */
+int rtu_transact(int fd, unsigned baud,
+                 const uint8_t *frame, size_t n,
+                 uint8_t *reply, size_t rmax,
+                 unsigned timeout_ms);
+
+#endif // RTU_H
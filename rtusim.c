@@ -0,0 +1,330 @@
+/** Simulated Modbus RTU servers on a pty
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "mbus.h"
+#include "rtu.h"
+#include "rtusim.h"
+
+struct simdev {
+    uint16_t *regs;
+    uint8_t *coils;
+    unsigned nregs;
+};
+
+struct rtusim {
+    int master, slave;
+    char port[64];
+
+    unsigned count, nregs;
+    unsigned delay_us;
+    unsigned frag;
+    unsigned long nreply;
+
+    struct mbus_ctx *ctx;
+    struct simdev *dev;
+};
+
+static void sim_read_holding(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, uint16_t * restrict result)
+{
+    struct simdev *dev = ctx->user;
+    if(addr>=dev->nregs || count>dev->nregs-addr)
+        mbus_ctx_exception(ctx, 2);
+    else
+        memcpy(result, dev->regs+addr, 2*count);
+}
+
+static void sim_write_holding(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
+{
+    struct simdev *dev = ctx->user;
+    if(addr>=dev->nregs)
+        mbus_ctx_exception(ctx, 2);
+    else
+        dev->regs[addr] = value;
+}
+
+static void sim_write_holding_multi(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, const uint16_t * restrict value)
+{
+    struct simdev *dev = ctx->user;
+    if(addr>=dev->nregs || count>dev->nregs-addr)
+        mbus_ctx_exception(ctx, 2);
+    else
+        memcpy(dev->regs+addr, value, 2*count);
+}
+
+static void sim_read_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    struct simdev *dev = ctx->user;
+    unsigned i;
+    if(addr>=dev->nregs || count>dev->nregs-addr) {
+        mbus_ctx_exception(ctx, 2);
+        return;
+    }
+    for(i=0; i<count; i++) {
+        if(dev->coils[addr+i])
+            result[i/8] |= 1<<(i%8);
+    }
+}
+
+static void sim_write_coils(struct mbus_ctx *ctx, uint16_t addr, uint16_t count, const uint8_t * restrict value)
+{
+    struct simdev *dev = ctx->user;
+    unsigned i;
+    if(addr>=dev->nregs || count>dev->nregs-addr) {
+        mbus_ctx_exception(ctx, 2);
+        return;
+    }
+    for(i=0; i<count; i++)
+        dev->coils[addr+i] = (value[i/8]>>(i%8))&1;
+}
+
+// discrete inputs read back the coils
+static const struct mbus_ops sim_ops = {
+    .read_holding = sim_read_holding,
+    .write_holding = sim_write_holding,
+    .write_holding_multi = sim_write_holding_multi,
+    .read_coils = sim_read_coils,
+    .read_discrete = sim_read_coils,
+    .write_coils = sim_write_coils,
+};
+
+struct rtusim *rtusim_create(uint8_t first, unsigned count, unsigned nregs)
+{
+    struct rtusim *sim;
+    struct termios tio;
+    unsigned i;
+
+    if(count==0 || first==0 || first+count>248 || nregs==0 || nregs>0x10000) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sim = calloc(1, sizeof(*sim));
+    if(!sim)
+        return NULL;
+    sim->master = sim->slave = -1;
+    sim->count = count;
+    sim->nregs = nregs;
+
+    sim->ctx = calloc(count, sizeof(*sim->ctx));
+    sim->dev = calloc(count, sizeof(*sim->dev));
+    if(!sim->ctx || !sim->dev)
+        goto fail;
+
+    for(i=0; i<count; i++) {
+        sim->dev[i].nregs = nregs;
+        sim->dev[i].regs = calloc(nregs, sizeof(uint16_t));
+        sim->dev[i].coils = calloc(nregs, 1);
+        if(!sim->dev[i].regs || !sim->dev[i].coils)
+            goto fail;
+        mbus_ctx_init(&sim->ctx[i], &sim_ops, &sim->dev[i]);
+        mbus_ctx_set_unit(&sim->ctx[i], first+i);
+    }
+
+    sim->master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+    if(sim->master<0 || grantpt(sim->master) || unlockpt(sim->master))
+        goto fail;
+    if(ptsname_r(sim->master, sim->port, sizeof(sim->port)))
+        goto fail;
+
+    // keep the slave open so that reads don't fail (EIO)
+    // when no master program has it open.
+    sim->slave = open(sim->port, O_RDWR|O_NOCTTY|O_CLOEXEC);
+    if(sim->slave<0)
+        goto fail;
+
+    if(tcgetattr(sim->slave, &tio))
+        goto fail;
+    cfmakeraw(&tio);
+    if(tcsetattr(sim->slave, TCSANOW, &tio))
+        goto fail;
+
+    return sim;
+fail:
+    rtusim_destroy(sim);
+    return NULL;
+}
+
+void rtusim_destroy(struct rtusim *sim)
+{
+    unsigned i;
+    if(!sim)
+        return;
+    if(sim->master>=0)
+        close(sim->master);
+    if(sim->slave>=0)
+        close(sim->slave);
+    if(sim->dev) {
+        for(i=0; i<sim->count; i++) {
+            free(sim->dev[i].regs);
+            free(sim->dev[i].coils);
+        }
+    }
+    free(sim->dev);
+    free(sim->ctx);
+    free(sim);
+}
+
+const char *rtusim_port(const struct rtusim *sim)
+{
+    return sim->port;
+}
+
+void rtusim_set_delay(struct rtusim *sim, unsigned delay_us)
+{
+    sim->delay_us = delay_us;
+}
+
+void rtusim_set_fragment(struct rtusim *sim, unsigned nbytes)
+{
+    sim->frag = nbytes;
+}
+
+unsigned long rtusim_count(const struct rtusim *sim)
+{
+    return sim->nreply;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ull + ts.tv_nsec/1000;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t n)
+{
+    while(n) {
+        ssize_t ret = write(fd, buf, n);
+        if(ret<0 && errno==EINTR)
+            continue;
+        else if(ret<0)
+            return -1;
+        buf += ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+// RX timeout for all instances.  End of frame.
+static void sim_timeout(struct rtusim *sim)
+{
+    unsigned i;
+    for(i=0; i<sim->count; i++) {
+        struct mbus_ctx *ctx = &sim->ctx[i];
+        ctx->status &= ~MBUS_RX_ERROR;
+        mbus_ctx_process(ctx);
+    }
+}
+
+/* pass received bytes to all instances, and send any reply.
+ * Returns the number of bytes used, which is less than n
+ * if a reply ended the request early.
+ */
+static ssize_t sim_input(struct rtusim *sim, const uint8_t *buf, uint8_t n)
+{
+    unsigned i;
+
+    for(i=0; i<sim->count; i++) {
+        struct mbus_ctx *ctx = &sim->ctx[i];
+        uint8_t reply[RTU_MAX_FRAME], used, len;
+
+        used = mbus_ctx_feed(ctx, buf, n);
+
+        if(!(ctx->status&MBUS_TX_READY))
+            continue;
+
+        len = mbus_ctx_drain(ctx, reply, sizeof(reply)-1);
+
+        if(sim->delay_us)
+            usleep(sim->delay_us);
+
+        if(!sim->frag) {
+            if(write_all(sim->master, reply, len))
+                return -1;
+        } else {
+            uint8_t off, n;
+            for(off=0; off<len; off+=n) {
+                n = len-off<sim->frag ? len-off : sim->frag;
+                if(write_all(sim->master, reply+off, n))
+                    return -1;
+                if(off+n<len)
+                    usleep(n*11000000u/115200u);
+            }
+        }
+        sim->nreply++;
+
+        // the reply ends this request for all instances
+        sim_timeout(sim);
+        return used;
+    }
+    return n;
+}
+
+int rtusim_run(struct rtusim *sim, volatile int *stop)
+{
+    unsigned gap = rtu_gap_us(0);
+    uint64_t last = 0;
+    int partial = 0;
+
+    while(!*stop) {
+        struct pollfd pfd = {sim->master, POLLIN, 0};
+        uint8_t buf[RTU_MAX_FRAME];
+        ssize_t i, n;
+        int ret;
+
+        ret = poll(&pfd, 1, partial ? (gap+999)/1000 : 100);
+        if(ret<0 && errno==EINTR)
+            continue;
+        else if(ret<0)
+            return -1;
+
+        if(partial && now_us()-last>=gap) {
+            sim_timeout(sim);
+            partial = 0;
+        }
+
+        if(ret==0)
+            continue;
+
+        n = read(sim->master, buf, sizeof(buf));
+        if(n<0 && (errno==EINTR || errno==EAGAIN))
+            continue;
+        else if(n<=0)
+            return -1;
+
+        last = now_us();
+        partial = 1;
+
+        for(i=0; i<n; ) {
+            ssize_t used = sim_input(sim, buf+i, n-i>255 ? 255 : n-i);
+            if(used<0)
+                return -1;
+            i += used;
+        }
+    }
+    return 0;
+}
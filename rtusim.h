@@ -0,0 +1,68 @@
+/** Simulated Modbus RTU servers on a pty
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef RTUSIM_H
+#define RTUSIM_H
+
+#include <inttypes.h>
+
+/* Host build of the mbus server on a pseudo-terminal.
+ *
+ * One pty is one bus, with some number of server instances
+ * (struct mbus_ctx) at consecutive unit addresses.
+ * Each instance has its own holding registers and coils.
+ * Master programs open the pty slave with rtu_open().
+ */
+struct rtusim;
+
+/** @brief Create a simulated bus
+ *
+ * count servers with unit addresses first, first+1, ...
+ * each with nregs holding registers (and nregs coils)
+ * initialized to zero.
+ * Returns NULL on error.
+ */
+struct rtusim *rtusim_create(uint8_t first, unsigned count, unsigned nregs);
+
+void rtusim_destroy(struct rtusim *sim);
+
+//! Name of the pty slave device for masters to open
+const char *rtusim_port(const struct rtusim *sim);
+
+//! Delay between request and reply, to simulate a slow device
+void rtusim_set_delay(struct rtusim *sim, unsigned delay_us);
+
+/** @brief Send each reply in pieces
+ *
+ * Write replies nbytes at a time, pausing between writes for the
+ * time the bytes take at 115200 baud.  So a master sees a reply
+ * split across read()s, as it would from a UART.
+ * 0 (the default) writes each reply at once.
+ */
+void rtusim_set_fragment(struct rtusim *sim, unsigned nbytes);
+
+/** @brief Serve requests until *stop is non-zero
+ *
+ * *stop is checked at least every 100ms.
+ * Returns 0 when stopped, or -1 on error.
+ */
+int rtusim_run(struct rtusim *sim, volatile int *stop);
+
+//! Number of requests answered
+unsigned long rtusim_count(const struct rtusim *sim);
+
+#endif // RTUSIM_H
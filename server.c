@@ -29,10 +29,40 @@
 #  error F_CPU must be defined
 #endif
 
+#ifndef SERVER_BAUD
+#  define SERVER_BAUD 115200
+#endif
+
+/* Modbus RTU inter-frame timing.
+ *
+ * A gap of more than 1.5 character times within a frame makes
+ * the frame invalid.  A gap of 3.5 character times ends a frame.
+ * Above 19200 baud these are fixed at 750us and 1750us.
+ *
+ * Measured with Timer0 (F_CPU/1024, 64us at 16MHz), so the
+ * resolution is one timer tick.
+ */
+#if SERVER_BAUD>19200
+#  define T15_US 750ul
+#  define T35_US 1750ul
+#else
+   // 11 bits per character
+#  define T15_US (15ul*11*100000ul/SERVER_BAUD)
+#  define T35_US (35ul*11*100000ul/SERVER_BAUD)
+#endif
+
+#define US_TO_TICKS(US) (((US)*(F_CPU/1000ul)+1024000ul-1)/1024000ul)
+#define T15_TICKS US_TO_TICKS(T15_US)
+#define T35_TICKS US_TO_TICKS(T35_US)
+
+#if T35_TICKS>255
+#  error SERVER_BAUD too low for Timer0 gap detection
+#endif
+
 static inline void setupuart(void)
 {
 #define BAUD_TOL 3
-#define BAUD 115200
+#define BAUD SERVER_BAUD
 #include <util/setbaud.h>
     UBRR0H = UBRRH_VALUE;
     UBRR0L = UBRRL_VALUE;
@@ -43,8 +73,8 @@ static inline void setupuart(void)
 #endif
     /* 8 N 1 */
     UCSR0C = _BV(UCSZ00)|_BV(UCSZ01);
-    /* Enable Tx/Rx */
-    UCSR0B = _BV(TXEN0)|_BV(RXEN0);
+    /* Enable Tx/Rx, and RX complete interrupt */
+    UCSR0B = _BV(TXEN0)|_BV(RXEN0)|_BV(RXCIE0);
 #undef BAUD
 #undef BAUD_TOL
 #ifdef USE_2X
@@ -52,7 +82,241 @@ static inline void setupuart(void)
 #endif
 }
 
-uint8_t timo_active;
+/* UART ring buffers.
+ *
+ * Single producer, single consumer.  Each index is only written
+ * by one side (ISR or main loop), so no locking is needed.
+ * Sizes must be powers of 2, and <=128.  RX at least 8 (see rx_sof).
+ */
+#ifndef SERVER_RX_RING
+#  define SERVER_RX_RING 64
+#endif
+#ifndef SERVER_TX_RING
+#  define SERVER_TX_RING 32
+#endif
+
+#if SERVER_RX_RING<8 || SERVER_RX_RING>128 || (SERVER_RX_RING&(SERVER_RX_RING-1))
+#  error SERVER_RX_RING must be a power of 2 from 8 to 128
+#endif
+#if SERVER_TX_RING<2 || SERVER_TX_RING>128 || (SERVER_TX_RING&(SERVER_TX_RING-1))
+#  error SERVER_TX_RING must be a power of 2 from 2 to 128
+#endif
+
+static uint8_t rx_ring[SERVER_RX_RING];
+//! Arrival time of each rx_ring entry.  See server_ticks()
+static uint16_t rx_time[SERVER_RX_RING];
+//! One bit per rx_ring entry.  Set for the first byte after a t3.5 gap
+static uint8_t rx_sof[SERVER_RX_RING/8];
+static volatile uint8_t rx_head; // written by ISR
+static volatile uint8_t rx_tail; // written by main loop
+//! Set by ISR on UART framing, overrun, or parity error.  UCSR0A error bits
+static volatile uint8_t rx_fault;
+//! Set by ISR when a byte is dropped because rx_ring is full
+static volatile uint8_t rx_overflow;
+
+/* Gap detection state
+ *
+ * GAP_IDLE - Not timing.  t3.5 has passed since the last byte.
+ * GAP_T15  - Waiting for t1.5 after the last byte.
+ * GAP_T35  - t1.5 passed, waiting for t3.5.  A byte now is an error.
+ */
+#define GAP_IDLE 0
+#define GAP_T15 1
+#define GAP_T35 2
+static volatile uint8_t gap_state;
+/* Set by ISR when t3.5 passes.  Cleared when the next byte is queued,
+ * with its rx_sof bit set.  So every frame boundary is kept in the ring,
+ * however far behind the main loop is.
+ */
+static uint8_t rx_gap = 1;
+//! Drop received bytes until the next t3.5 gap
+static uint8_t rx_discard;
+
+/* Latency measurement
+ *
+ * Timestamps are Timer0 ticks extended to 16 bits by counting overflows.
+ * Each byte in rx_ring has its arrival time in rx_time.  When a byte
+ * completes a request, the main loop copies its time to lat_start.
+ * So the measurement isn't shortened when more input has arrived
+ * since.  The UDRE ISR finishes the measurement when it sends the
+ * first byte of the reply.
+ */
+static volatile uint8_t t0_ovf;
+static uint16_t lat_start;
+static volatile uint8_t lat_pending;
+
+static uint16_t lat_hist[SERVER_LAT_NBUCKET];
+static uint16_t lat_last, lat_max;
+
+// call with interrupts disabled
+static uint16_t now_ticks(void)
+{
+    uint8_t lo = TCNT0, hi = t0_ovf;
+    // overflow not yet handled
+    if((TIFR0&_BV(TOV0)) && lo<128)
+        hi++;
+    return (uint16_t)hi<<8 | lo;
+}
+
+uint16_t server_ticks(void)
+{
+    uint16_t ret;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ret = now_ticks();
+    }
+    return ret;
+}
+
+// call with interrupts disabled
+static void lat_record(uint16_t dt)
+{
+    uint8_t b = 0;
+    uint16_t v = dt;
+
+    while(v && b<SERVER_LAT_NBUCKET-1) {
+        b++;
+        v >>= 1;
+    }
+    if(lat_hist[b]!=0xffff)
+        lat_hist[b]++;
+
+    lat_last = dt;
+    if(dt>lat_max)
+        lat_max = dt;
+}
+
+uint16_t server_latency_read(uint8_t idx)
+{
+    uint16_t ret = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if(idx==SERVER_LAT_LAST)
+            ret = lat_last;
+        else if(idx==SERVER_LAT_MAX)
+            ret = lat_max;
+        else if(idx<SERVER_LAT_NREG)
+            ret = lat_hist[idx-SERVER_LAT_HIST];
+    }
+    return ret;
+}
+
+void server_latency_copy(uint16_t *dst)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        dst[SERVER_LAT_LAST] = lat_last;
+        dst[SERVER_LAT_MAX] = lat_max;
+        memcpy(dst+SERVER_LAT_HIST, lat_hist, sizeof(lat_hist));
+    }
+}
+
+void server_latency_reset(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        memset(lat_hist, 0, sizeof(lat_hist));
+        lat_last = lat_max = 0;
+    }
+}
+
+static uint8_t tx_ring[SERVER_TX_RING];
+static volatile uint8_t tx_head; // written by main loop
+static volatile uint8_t tx_tail; // written by ISR
+
+ISR(USART_RX_vect)
+{
+    uint8_t sts = UCSR0A, data = UDR0;
+    uint8_t head = rx_head, next = (head+1)&(SERVER_RX_RING-1);
+
+    if(gap_state==GAP_T35) {
+        // more than t1.5 since previous byte, but less than t3.5.
+        // The frame in progress is invalid.
+        rx_discard = 1;
+    }
+
+    // (re)start gap timing
+    OCR0B = TCNT0 + T15_TICKS;
+    TIFR0 = _BV(OCF0B);
+    TIMSK0 |= _BV(OCIE0B);
+    gap_state = GAP_T15;
+
+    if(rx_discard) {
+        // drop
+    } else if(sts&(_BV(FE0)|_BV(DOR0)|_BV(UPE0))) {
+        rx_fault |= sts&(_BV(FE0)|_BV(DOR0)|_BV(UPE0));
+    } else if(next==rx_tail) {
+        rx_overflow = 1;
+    } else {
+        uint8_t bit = 1<<(head&7);
+        rx_ring[head] = data;
+        rx_time[head] = now_ticks();
+        if(rx_gap)
+            rx_sof[head/8] |= bit;
+        else
+            rx_sof[head/8] &= ~bit;
+        rx_gap = 0;
+        rx_head = next;
+    }
+}
+
+ISR(TIMER0_COMPB_vect)
+{
+    if(gap_state==GAP_T15) {
+        gap_state = GAP_T35;
+        OCR0B += T35_TICKS-T15_TICKS;
+    } else {
+        // end of frame
+        gap_state = GAP_IDLE;
+        TIMSK0 &= ~_BV(OCIE0B);
+        rx_discard = 0;
+        rx_gap = 1;
+    }
+}
+
+ISR(USART_UDRE_vect)
+{
+    uint8_t tail = tx_tail;
+
+    if(tail==tx_head) {
+        // empty
+        UCSR0B &= ~_BV(UDRIE0);
+    } else {
+        UDR0 = tx_ring[tail];
+        tx_tail = (tail+1)&(SERVER_TX_RING-1);
+
+        if(lat_pending) {
+            // first byte of reply
+            lat_pending = 0;
+            lat_record(now_ticks()-lat_start);
+        }
+    }
+}
+
+// Move reply bytes from mbus to the TX ring until one is full or empty
+static void pump_tx(void)
+{
+    uint8_t head = tx_head, moved = 0;
+
+    while(mbus_status&MBUS_TX_READY) {
+        // free space from head to the end of the ring.
+        // One entry is always left empty.
+        uint8_t tail = tx_tail, space, n;
+        if(tail>head)
+            space = tail-head-1;
+        else
+            space = SERVER_TX_RING-head-(tail==0);
+        if(!space)
+            break; // full
+
+        n = mbus_drain(tx_ring+head, space);
+        head = (head+n)&(SERVER_TX_RING-1);
+        moved = 1;
+    }
+
+    if(moved) {
+        tx_head = head;
+        UCSR0B |= _BV(UDRIE0);
+    }
+}
+
+volatile uint8_t timo_active;
 
 int main(void) __attribute__ ((OS_main));
 int main(void)
@@ -64,42 +328,70 @@ int main(void)
     DDRB  = _BV(DDB5);
     PORTB &= ~_BV(PB5);
 
-    // setup timer0
+    // setup timer0, free running
+    TCCR0A = 0;
     TCCR0B = _BV(CS00)|_BV(CS02); // /1024
+    TIMSK0 = _BV(TOIE0);
 
     user_init();
     sei();
 
     while(1) {
-        uint8_t do_proc = 0;
-        uint8_t usts;
+        uint8_t tail;
 
         user_loop();
 
-        usts = UCSR0A;
-
-        // if mbus has data to send, and
-        // UART can accept.
-        if(mbus_status&MBUS_TX_READY &&
-                (usts&_BV(UDRE0)))
-        {
-            UDR0 = mbus_out_byte;
-            mbus_status &= ~MBUS_TX_READY;
-            do_proc = 1;
+        if(rx_fault || rx_overflow) {
+            // RX error or overflow
+            uint8_t fault, overflow;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                fault = rx_fault;
+                overflow = rx_overflow;
+                rx_fault = rx_overflow = 0;
+            }
+            if(fault&_BV(FE0))
+                mbus_diag.framing++;
+            if(fault&_BV(UPE0))
+                mbus_diag.parity++;
+            if((fault&_BV(DOR0)) || overflow)
+                mbus_diag.overrun++;
+            mbus_diag.blackouts++;
+            // clear any partially received input
+            rx_tail = rx_head;
+            mbus_status&=~MBUS_RX_ERROR;
+            mbus_rx_clear();
+            // setup timeout
+            timo_active=0xff;
+            PORTB |= _BV(PB5); // turn on LED
         }
 
-        if(timo_active)
-            continue;
+        pump_tx();
+
+        // Process all received bytes, unless mbus is still replying.
+        tail = rx_tail;
+        while(!(mbus_status&MBUS_TX_READY)) {
+            uint8_t data;
+            uint16_t stamp;
+
+            if(tail==rx_head)
+                break;
+
+            if(rx_sof[tail/8]&(1<<(tail&7))) {
+                // frame boundary.  Resync receiver with an RX timeout
+                mbus_process();
+            }
 
-        if(usts&_BV(RXC0) && !(mbus_status&MBUS_RX_READY)) {
-            uint8_t data = UDR0;
-            // UART received data
-            if((usts&(_BV(FE0)|_BV(DOR0)|_BV(UPE0))) ||
-               mbus_status&MBUS_RX_ERROR)
-            {
-                // RX error or overflow
+            data = rx_ring[tail];
+            stamp = rx_time[tail];
+            tail = (tail+1)&(SERVER_RX_RING-1);
+
+            if(timo_active) {
+                // ignore input during timeout
+            } else if(mbus_status&MBUS_RX_ERROR) {
+                // protocol error
                 // clear any partially received input
                 mbus_status&=~MBUS_RX_ERROR;
+                mbus_diag.blackouts++;
                 mbus_rx_clear();
                 // setup timeout
                 timo_active=0xff;
@@ -107,18 +399,28 @@ int main(void)
             } else {
                 mbus_in_byte = data;
                 mbus_status |= MBUS_RX_READY;
-                do_proc = 1;
+                mbus_process();
+
+                if(mbus_status&MBUS_TX_READY) {
+                    // request complete, reply is ready
+                    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                        lat_start = stamp;
+                    }
+                    lat_pending = 1;
+                }
             }
-        }
 
-        if(do_proc)
-            mbus_process();
+            rx_tail = tail;
+            pump_tx();
+        }
     }
 }
 
 ISR(TIMER0_OVF_vect)
 {
     uint8_t ta = timo_active;
+
+    t0_ovf++;
     if(ta) {
         ta--;
         timo_active=ta;
@@ -12,4 +12,38 @@ void user_loop(void);
 //! Called periodically from a timer ISR
 void user_tick(void);
 
+/** @brief Free running time in Timer0 ticks
+ *
+ * 1024/F_CPU (64us at 16MHz).  Wraps after 2^16 ticks (4.2 sec.).
+ * May be called from an ISR.
+ */
+uint16_t server_ticks(void);
+
+/* Request to reply latency.
+ *
+ * Time from the arrival of the last byte of a request to the first
+ * byte of the reply being written to the UART.  In Timer0 ticks of
+ * 1024/F_CPU (64us at 16MHz).
+ *
+ * Bucket 0 counts replies within one tick.  Bucket N>0 counts
+ * latencies of 2^(N-1) through 2^N-1 ticks.  The last bucket
+ * also counts anything longer.  Counts stop at 0xffff.
+ */
+#define SERVER_LAT_NBUCKET 16
+
+//! Values of server_latency_read()
+#define SERVER_LAT_LAST 0
+#define SERVER_LAT_MAX 1
+#define SERVER_LAT_HIST 2 //!< first bucket
+#define SERVER_LAT_NREG (SERVER_LAT_HIST+SERVER_LAT_NBUCKET)
+
+//! idx is one of SERVER_LAT_*, or SERVER_LAT_HIST+bucket number
+uint16_t server_latency_read(uint8_t idx);
+
+//! Copy all SERVER_LAT_NREG values at once.  dst[idx] is as server_latency_read(idx)
+void server_latency_copy(uint16_t *dst);
+
+//! Clear histogram, last, and max
+void server_latency_reset(void);
+
 #endif // SERVER_H
@@ -28,3 +28,27 @@ void __attribute__((weak)) mbus_read_holding(uint16_t addr, uint8_t count, uint1
 {}
 void __attribute__((weak)) mbus_write_holding(uint16_t addr, uint16_t value)
 {}
+void __attribute__((weak)) mbus_write_holding_multi(uint16_t addr, uint8_t count, const uint16_t * restrict value)
+{
+    while(count-- && !(mbus_status&MBUS_RX_ERROR))
+        mbus_write_holding(addr++, *value++);
+}
+void __attribute__((weak)) mbus_read_coils(uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    mbus_exception(1);
+}
+void __attribute__((weak)) mbus_read_discrete(uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    mbus_exception(1);
+}
+void __attribute__((weak)) mbus_write_coils(uint16_t addr, uint16_t count, const uint8_t * restrict value)
+{
+    mbus_exception(1);
+}
+uint8_t __attribute__((weak)) mbus_read_fifo(uint16_t addr, uint8_t max, uint16_t * restrict result)
+{
+    mbus_exception(1);
+    return 0;
+}
+void __attribute__((weak)) mbus_read_begin(void)
+{}
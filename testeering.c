@@ -0,0 +1,201 @@
+/** Test of EEPROM ring slot selection
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Simulates EEPROM as an array, and power loss during
+ * a slot write after each byte.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eering.h"
+#include "testutil.h"
+
+// simulated EEPROM
+
+#define EESIZE 1024
+
+static uint8_t eeprom[EESIZE];
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    uintptr_t a = (uintptr_t)addr;
+    if(a>=EESIZE) {
+        testOk(0, "read past end %lu", (unsigned long)a);
+        return 0xff;
+    }
+    return eeprom[a];
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    while(n--)
+        *d++ = eeprom_read_byte(s++);
+}
+
+// write the first n bytes of a slot image
+static void ee_write(uint16_t addr, const uint8_t *slot, size_t n)
+{
+    memcpy(eeprom+addr, slot, n);
+}
+
+#define BASE 16
+#define NSLOT 5
+#define LEN 12
+
+static void fill(uint8_t *data, unsigned save)
+{
+    unsigned i;
+    for(i=0; i<LEN; i++)
+        data[i] = save*31+i;
+}
+
+static void testEmpty(void)
+{
+    struct eering R;
+    uint8_t data[LEN] = {0};
+
+    testDiag("Testing erased and zeroed EEPROM");
+
+    memset(eeprom, 0xff, sizeof(eeprom));
+    eering_init(&R, BASE, NSLOT, LEN);
+    testOk1(eering_load(&R, data)==0);
+    testOk1(R.next==0);
+
+    memset(eeprom, 0, sizeof(eeprom));
+    testOk1(eering_load(&R, data)==0);
+}
+
+static void testRotate(void)
+{
+    struct eering R;
+    uint8_t data[LEN], slot[EERING_SLOT(LEN)], expect[LEN];
+    unsigned save, nbad = 0;
+    uint16_t addrs[NSLOT];
+
+    testDiag("Testing rotation through slots");
+
+    memset(eeprom, 0xff, sizeof(eeprom));
+    eering_init(&R, BASE, NSLOT, LEN);
+
+    for(save=0; save<3*NSLOT; save++) {
+        uint16_t addr;
+
+        fill(data, save);
+        addr = eering_pack(&R, data, slot);
+        ee_write(addr, slot, sizeof(slot));
+
+        if(save<NSLOT)
+            addrs[save] = addr;
+        else if(addrs[save%NSLOT]!=addr)
+            nbad++;
+
+        // reboot
+        eering_init(&R, BASE, NSLOT, LEN);
+        fill(expect, save);
+        if(!eering_load(&R, data) || memcmp(data, expect, LEN)!=0 || R.next!=(save+1)%NSLOT)
+            nbad++;
+    }
+    testOk(nbad==0, "%u errors", nbad);
+
+    for(save=0; save<NSLOT; save++) {
+        if(addrs[save]!=BASE+save*EERING_SLOT(LEN))
+            nbad++;
+    }
+    testOk(nbad==0, "slot addresses");
+    // nothing outside of the ring is touched
+    testOk1(eeprom[BASE-1]==0xff && eeprom[BASE+NSLOT*EERING_SLOT(LEN)]==0xff);
+}
+
+/* Interrupt save number 'save' after each byte, with that byte left
+ * unchanged, erased, or written.  The previous snapshot must be found,
+ * unless the whole slot was written.
+ */
+static void testPowerLoss(uint16_t firstseq)
+{
+    struct eering R;
+    uint8_t data[LEN], slot[EERING_SLOT(LEN)], expect[LEN];
+    uint8_t saved[EESIZE];
+    unsigned save, n, nbad = 0, ncase = 0;
+
+    testDiag("Testing power loss during each byte.  Starting with sequence 0x%04x", firstseq);
+
+    for(save=1; save<2*NSLOT+2; save++) {
+        unsigned torn;
+
+        // setup EEPROM with 'save' complete snapshots
+        memset(eeprom, 0xff, sizeof(eeprom));
+        eering_init(&R, BASE, NSLOT, LEN);
+        R.seq = firstseq;
+        for(n=0; n<save; n++) {
+            uint16_t addr;
+            fill(data, n);
+            addr = eering_pack(&R, data, slot);
+            ee_write(addr, slot, sizeof(slot));
+        }
+        memcpy(saved, eeprom, sizeof(saved));
+
+        for(n=0; n<=sizeof(slot); n++) {
+            for(torn=0; torn<3; torn++) {
+                struct eering B = R;
+                uint16_t addr;
+                int whole;
+
+                memcpy(eeprom, saved, sizeof(eeprom));
+
+                fill(data, save);
+                addr = eering_pack(&B, data, slot);
+                ee_write(addr, slot, n);
+                if(n<sizeof(slot) && torn==1)
+                    eeprom[addr+n] = 0xff; // erased, not yet written
+                else if(n<sizeof(slot) && torn==2)
+                    eeprom[addr+n] = slot[n]; // written
+                // remaining bytes may already hold the new values
+                whole = memcmp(eeprom+addr, slot, sizeof(slot))==0;
+
+                // reboot
+                eering_init(&B, BASE, NSLOT, LEN);
+                fill(expect, whole ? save : save-1);
+                if(!eering_load(&B, data) || memcmp(data, expect, LEN)!=0) {
+                    nbad++;
+                    testDiag("save %u byte %u torn %u fails", save, n, torn);
+                }
+
+                // next save after recovery goes to the slot after the one found
+                if(B.next!=(whole ? save+1 : save)%NSLOT)
+                    nbad++;
+                ncase++;
+            }
+        }
+    }
+    testOk(nbad==0, "%u of %u cases fail", nbad, ncase);
+}
+
+int main(int argc, char** argv)
+{
+    testPlan(9);
+
+    testEmpty();
+    testRotate();
+    testPowerLoss(0xffff);
+    testPowerLoss(0xfffc);
+    testPowerLoss(0x7ffe);
+
+    return testDone();
+}
@@ -0,0 +1,176 @@
+/** Test of the RTU master against a pty peer
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "rtu.h"
+#include "mbmaster.h"
+#include "testutil.h"
+
+#define NELEMENTS(X) (sizeof(X)/sizeof(*(X)))
+
+/* The test plays the server on the pty master side.
+ * Each reply is written in pieces, with mbmaster_process() between
+ * them, as a UART delivers a frame to read() in chunks.
+ */
+
+// read 2 holding registers from unit 1
+static const uint8_t request[] = {0x03, 0x00, 0x10, 0x00, 0x02};
+
+static const struct {
+    const char *name;
+    uint8_t frame[9];
+    uint8_t len;
+    int status;
+} replies[] = {
+    {"normal",        {0x01, 0x03, 0x04, 0x12, 0x34, 0x56, 0x78}, 7, 0},
+    {"CRC exception", {0x01, 0x83, 0x02}, 3, 2},
+    // 4 byte form sent by mbus.c
+    {"LRC exception", {0x01, 0x83, 0x02, 0x7A}, 4, 2},
+};
+
+// size of the first, and each later, write().  0 for the remainder
+static const struct {
+    const char *name;
+    uint8_t first, rest;
+} splits[] = {
+    {"whole",           0, 0},
+    {"4 then the rest", 4, 0},
+    {"byte by byte",    1, 1},
+};
+
+struct result {
+    int ncb, status;
+    size_t len;
+    uint8_t reply[RTU_MAX_FRAME];
+};
+
+static void done_cb(void *arg, int status, const uint8_t *reply, size_t len)
+{
+    struct result *R = arg;
+    R->ncb++;
+    R->status = status;
+    R->len = reply ? len : 0;
+    if(reply)
+        memcpy(R->reply, reply, len);
+}
+
+//! Wait up to timeout_ms for fd to be readable, then let the master run
+static void step(struct mbmaster *m, int fd, int timeout_ms)
+{
+    struct pollfd pfd[2] = {{fd, POLLIN, 0}, {mbmaster_timer_fd(m), POLLIN, 0}};
+    poll(pfd, 2, timeout_ms);
+    mbmaster_process(m);
+}
+
+static void testSplit(struct mbmaster *m, int ptm, size_t r, size_t s)
+{
+    struct result R;
+    uint8_t frame[RTU_MAX_FRAME], req[RTU_MAX_FRAME];
+    size_t flen, rlen = 0, off = 0;
+    int i, early = 0;
+
+    memset(&R, 0, sizeof(R));
+    memcpy(frame, replies[r].frame, replies[r].len);
+    flen = replies[r].len==4 ? 4 : rtu_add_crc(frame, replies[r].len);
+
+    if(mbmaster_submit(m, 1, request, sizeof(request), done_cb, &R)) {
+        testFail("%s, %s: submit", replies[r].name, splits[s].name);
+        return;
+    }
+
+    // wait for the request, after the gap from the previous reply
+    for(i=0; i<100 && rlen<sizeof(request)+3; i++) {
+        struct pollfd pfd = {ptm, POLLIN, 0};
+        ssize_t n;
+        step(m, -1, 0);
+        if(poll(&pfd, 1, 10)<=0)
+            continue;
+        n = read(ptm, req+rlen, sizeof(req)-rlen);
+        if(n>0)
+            rlen += n;
+    }
+    if(rlen!=sizeof(request)+3 || req[0]!=1 || rtu_check(req, rlen)) {
+        testFail("%s, %s: request not seen", replies[r].name, splits[s].name);
+        return;
+    }
+
+    while(off<flen) {
+        size_t n = off ? splits[s].rest : splits[s].first;
+        if(n==0 || n>flen-off)
+            n = flen-off;
+
+        if(write(ptm, frame+off, n)!=(ssize_t)n) {
+            testFail("%s, %s: write", replies[r].name, splits[s].name);
+            return;
+        }
+        off += n;
+        step(m, mbmaster_fd(m), 100);
+        if(off<flen && R.ncb)
+            early = 1;
+    }
+
+    for(i=0; i<100 && !R.ncb; i++)
+        step(m, mbmaster_fd(m), 10);
+
+    testOk(!early, "%s, %s: no callback before the last byte",
+           replies[r].name, splits[s].name);
+    testOk(R.ncb==1 && R.status==replies[r].status,
+           "%s, %s: status %d (expect %d)", replies[r].name, splits[s].name,
+           R.status, replies[r].status);
+    testOk(R.len==flen && memcmp(R.reply, frame, flen)==0,
+           "%s, %s: reply of %u bytes (expect %u)", replies[r].name, splits[s].name,
+           (unsigned)R.len, (unsigned)flen);
+}
+
+int main(int argc, char** argv)
+{
+    struct mbmaster *m;
+    char port[64];
+    size_t r, s;
+    int ptm;
+
+    testPlan(NELEMENTS(replies)*NELEMENTS(splits)*3);
+
+    ptm = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+    if(ptm<0 || grantpt(ptm) || unlockpt(ptm) || ptsname_r(ptm, port, sizeof(port))) {
+        perror("posix_openpt");
+        return 1;
+    }
+    m = mbmaster_create(port, 19200);
+    if(!m) {
+        perror("mbmaster_create");
+        return 1;
+    }
+
+    testDiag("Testing replies split across read()s");
+
+    for(r=0; r<NELEMENTS(replies); r++) {
+        for(s=0; s<NELEMENTS(splits); s++)
+            testSplit(m, ptm, r, s);
+    }
+
+    mbmaster_destroy(m);
+    close(ptm);
+    return testDone();
+}
@@ -16,112 +16,24 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <stdlib.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "mbus.h"
+#include "testutil.h"
 
-// testing infrastructure
-
-static size_t npass, nfail, nplan;
-
-void testDiag(const char* fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    printf("# ");
-    vprintf(fmt, args);
-    printf("\n");
-    va_end(args);
-}
-
-void testPassV(const char* fmt, va_list args)
-{
-    npass++;
-    printf("ok - ");
-    vprintf(fmt, args);
-    printf("\n");
-}
-
-void testFailV(const char* fmt, va_list args)
-{
-    nfail++;
-    printf("fail - ");
-    vprintf(fmt, args);
-    printf("\n");
-}
-
-void testPass(const char* fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    testPassV(fmt, args);
-    va_end(args);
-}
-
-void testFail(const char* fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    testFailV(fmt, args);
-    va_end(args);
-}
-
-int testOk(int v, const char* fmt, ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    if(v)
-        testPassV(fmt, args);
-    else
-        testFailV(fmt, args);
-    return v;
-}
-
-#define testOk1(X) testOk(X, #X)
-
-static void testPlan(size_t N)
-{
-    nplan = N;
-}
-
-static int testDone(void)
-{
-    printf("\n");
-    if(nplan && npass+nfail!=nplan) {
-        printf("Planned %lu tests but ran %lu\n",
-               (unsigned long)nplan,
-               (unsigned long)(npass+nfail));
-    }
-
-    printf("%lu test pass\n",
-           (unsigned long)(npass));
-
-    if(nfail) {
-        printf("%lu tests failed!\n",
-               (unsigned long)nfail);
-    }
-
-    return nfail!=0;
-}
+// helpers
 
-uint16_t _crc16_update(uint16_t sum, uint8_t next)
+// append CRC to a message of length n.  Returns new length
+static
+size_t add_crc(uint8_t* data, size_t n)
 {
-    int n;
-    sum ^= next;
-    for(n=0; n<8; n++) {
-        if(sum&1)
-            sum = (sum>>1) ^ 0xa001;
-        else
-            sum = sum>>1;
-    }
-    //testDiag("Calculate CRC16 %04x", sum);
-    return sum;
+    uint16_t crc = calculate_crc(data, n);
+    data[n++] = crc;
+    data[n++] = crc>>8;
+    return n;
 }
 
-// helpers
-
 static
 int modbus_out_all(uint8_t* data, unsigned int maxdata)
 {
@@ -148,7 +60,11 @@ int modbus_in_all(uint8_t* data, size_t dsize)
     return data!=end || mbus_status&(MBUS_RX_READY|MBUS_RX_ERROR);
 }
 
+// order in which user hooks are called
+static unsigned hook_seq;
+
 static int read_fail;
+static unsigned read_seq;
 static size_t read_counter;
 static uint16_t read_addr;
 static uint8_t read_count;
@@ -157,6 +73,7 @@ void mbus_read_holding(uint16_t addr, uint8_t count, uint16_t * restrict result)
 {
     int i;
     read_counter++;
+    read_seq = ++hook_seq;
     read_addr = addr;
     read_count = count;
 
@@ -182,14 +99,230 @@ void mbus_write_holding(uint16_t addr, uint16_t value)
         mbus_exception(3);
 }
 
+static unsigned write_multi_seq;
+static size_t write_multi_counter;
+static uint16_t write_multi_addr, write_multi_data[MAX_BUFFER/2];
+static uint8_t write_multi_count;
+
+void mbus_write_holding_multi(uint16_t addr, uint8_t count, const uint16_t * restrict value)
+{
+    write_multi_counter++;
+    write_multi_seq = ++hook_seq;
+    write_multi_addr = addr;
+    write_multi_count = count;
+    memcpy(write_multi_data, value, 2*count);
+
+    if(write_fail)
+        mbus_exception(3);
+}
+
+// 16 coils, and as many discrete inputs
+static uint8_t coils[2] = {0x00, 0x00};
+static uint8_t inputs[2] = {0xA5, 0x3C};
+static size_t coil_read_counter, coil_write_counter;
+
+static void read_bits(const uint8_t *src, uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    uint16_t i;
+    if(addr>=16 || count>16-addr) {
+        mbus_exception(2);
+        return;
+    }
+    for(i=0; i<count; i++, addr++) {
+        if(src[addr/8]&(1<<(addr%8)))
+            result[i/8] |= 1<<(i%8);
+    }
+}
+
+void mbus_read_coils(uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    coil_read_counter++;
+    read_bits(coils, addr, count, result);
+}
+
+void mbus_read_discrete(uint16_t addr, uint16_t count, uint8_t * restrict result)
+{
+    coil_read_counter++;
+    read_bits(inputs, addr, count, result);
+}
+
+void mbus_write_coils(uint16_t addr, uint16_t count, const uint8_t * restrict value)
+{
+    uint16_t i;
+    coil_write_counter++;
+    if(addr>=16 || count>16-addr) {
+        mbus_exception(2);
+        return;
+    }
+    for(i=0; i<count; i++, addr++) {
+        coils[addr/8] &= ~(1<<(addr%8));
+        if(value[i/8]&(1<<(i%8)))
+            coils[addr/8] |= 1<<(addr%8);
+    }
+}
+
+void mbus_read_begin(void) {}
+
+// FIFO queue at address 0x1234.  Reading removes entries
+static uint16_t fifo_q[40];
+static uint8_t fifo_n, fifo_max;
+static size_t fifo_counter;
+
+uint8_t mbus_read_fifo(uint16_t addr, uint8_t max, uint16_t * restrict result)
+{
+    uint8_t n = fifo_n<max ? fifo_n : max;
+    fifo_counter++;
+    fifo_max = max;
+    if(addr!=0x1234) {
+        mbus_exception(2);
+        return 0;
+    }
+    memcpy(result, fifo_q, 2*n);
+    memmove(fifo_q, fifo_q+n, 2*(fifo_n-n));
+    fifo_n -= n;
+    return n;
+}
+
+// independent server instances
+
+struct instance {
+    uint16_t regs[8];
+    unsigned nread, nwrite;
+};
+
+static void inst_read_holding(struct mbus_ctx *ctx, uint16_t addr, uint8_t count, uint16_t * restrict result)
+{
+    struct instance *inst = ctx->user;
+    inst->nread++;
+    if(addr>=8 || count>8-addr) {
+        mbus_ctx_exception(ctx, 2);
+        return;
+    }
+    memcpy(result, inst->regs+addr, 2*count);
+}
+
+static void inst_write_holding(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
+{
+    struct instance *inst = ctx->user;
+    inst->nwrite++;
+    if(addr>=8) {
+        mbus_ctx_exception(ctx, 2);
+        return;
+    }
+    inst->regs[addr] = value;
+}
+
+static const struct mbus_ops inst_ops = {
+    .read_holding = inst_read_holding,
+    .write_holding = inst_write_holding,
+};
+
+// streaming reads from instance registers
+static unsigned stream_nbegin, stream_nreg;
+
+static void inst_stream_begin(struct mbus_ctx *ctx, uint16_t addr, uint8_t count)
+{
+    stream_nbegin++;
+    if(addr>=8 || count>8-addr)
+        mbus_ctx_exception(ctx, 2);
+}
+
+static uint16_t inst_stream_reg(struct mbus_ctx *ctx, uint16_t addr)
+{
+    struct instance *inst = ctx->user;
+    stream_nreg++;
+    return inst->regs[addr];
+}
+
+static const struct mbus_ops inst_stream_ops = {
+    .write_holding = inst_write_holding,
+    .stream_begin = inst_stream_begin,
+    .stream_reg = inst_stream_reg,
+};
+
+// any register may be read
+static uint16_t gen_stream_reg(struct mbus_ctx *ctx, uint16_t addr)
+{
+    stream_nreg++;
+    return addr^0xA55A;
+}
+
+static const struct mbus_ops gen_stream_ops = {
+    .stream_reg = gen_stream_reg,
+};
+
+// register map
+static uint16_t map_r[7];
+static unsigned map_nread, map_nwrite, map_nbegin;
+
+static uint16_t map_read(struct mbus_ctx *ctx, uint16_t addr)
+{
+    return 0x4000 | map_nread++;
+}
+
+static void map_write(struct mbus_ctx *ctx, uint16_t addr, uint16_t value)
+{
+    map_nwrite++;
+    if(value==0xDEAD) {
+        mbus_ctx_exception(ctx, 3);
+        return;
+    }
+    map_r[addr] = value;
+}
+
+static const struct mbus_reg test_map[7] MBUS_REGMAP = {
+    [0] = {.store=&map_r[0], .wmask=0xffff, .flags=MBUS_REG_RW},
+    [1] = {.store=&map_r[1], .flags=MBUS_REG_R},
+    [2] = {.store=&map_r[2], .wmask=0x00ff, .flags=MBUS_REG_RW},
+    [3] = {.store=&map_r[3], .write=map_write, .wmask=0xffff, .flags=MBUS_REG_RW},
+    [4] = {.read=map_read, .flags=MBUS_REG_R},
+    // [5] is a hole
+    [6] = {.store=&map_r[6], .wmask=0xffff, .flags=MBUS_REG_W},
+};
+
+static void map_read_begin(struct mbus_ctx *ctx)
+{
+    map_nbegin++;
+}
+
+// no holding register hooks
+static const struct mbus_ops map_ops = {
+    .read_begin = map_read_begin,
+};
+
+// pass one byte to an instance.  Returns non-zero if not accepted
+static
+int ctx_in(struct mbus_ctx *ctx, uint8_t data)
+{
+    if(ctx->status&(MBUS_RX_READY|MBUS_RX_ERROR|MBUS_TX_READY))
+        return 1;
+    ctx->in_byte = data;
+    ctx->status |= MBUS_RX_READY;
+    mbus_ctx_process(ctx);
+    return 0;
+}
+
+// take one byte from an instance.  Returns -1 if none is ready
+static
+int ctx_out(struct mbus_ctx *ctx)
+{
+    uint8_t data;
+    if(!(ctx->status&MBUS_TX_READY))
+        return -1;
+    data = ctx->out_byte;
+    ctx->status &= ~MBUS_TX_READY;
+    mbus_ctx_process(ctx);
+    return data;
+}
+
 // tests
 
 static void testRead(void)
 {
-    static uint8_t cmd[] = {0x1, 0x3, 0x12, 0x34, 0x00, 0x4, 0xBF, 0x00};
+    static uint8_t cmd[] = {0x1, 0x3, 0x12, 0x34, 0x00, 0x4, 0x00, 0xBF};
     static uint8_t rep[20];
     static uint8_t expect[] = {0x1, 0x3, 0x8, 0x0, 0x1, 0x2, 0x3,
-                               0x4, 0x5, 0x6, 0x7, 0xA6, 0x93};
+                               0x4, 0x5, 0x6, 0x7, 0x93, 0xA6};
 
     testDiag("Testing read holding registers (command 3)");
 
@@ -208,7 +341,7 @@ static void testRead(void)
 
 static void testWrite(void)
 {
-    static uint8_t cmd[] = {0x1, 0x6, 0x21, 0x43, 0x56, 0x78, 0xA0, 0x4D};
+    static uint8_t cmd[] = {0x1, 0x6, 0x21, 0x43, 0x56, 0x78, 0x4D, 0xA0};
     static uint8_t rep[20];
 
     testDiag("Testing write single holding register (command 6)");
@@ -228,9 +361,9 @@ static void testWrite(void)
 
 static void testInvalidFunc(void)
 {
-    static uint8_t cmd[] = {0x1, 0x08};
+    static uint8_t cmd[] = {0x1, 0x41};
     static uint8_t rep[20];
-    static uint8_t expect[] = {0x1, 0x88, 0x1, 0x76};
+    static uint8_t expect[] = {0x1, 0xC1, 0x1, 0x3D};
 
     testDiag("Testing reception of an invalid function code");
 
@@ -284,9 +417,9 @@ static void testBadCRC(void)
 
 static void testUserReadError(void)
 {
-    static uint8_t cmd[] = {0x1, 0x3, 0x12, 0x34, 0x00, 0x4, 0xBF, 0x00};
+    static uint8_t cmd[] = {0x1, 0x3, 0x12, 0x34, 0x00, 0x4, 0x00, 0xBF};
     static uint8_t rep[20];
-    static uint8_t expect[] = {0x1, 0x83, 0x2, 0x0};
+    static uint8_t expect[] = {0x1, 0x83, 0x2, 0x7A};
 
     read_fail = 1;
 
@@ -312,7 +445,7 @@ static void testUserReadError(void)
 
 static void testUserWriteError(void)
 {
-    static uint8_t cmd[] = {0x1, 0x6, 0x21, 0x43, 0x56, 0x78, 0xA0, 0x4D};
+    static uint8_t cmd[] = {0x1, 0x6, 0x21, 0x43, 0x56, 0x78, 0x4D, 0xA0};
     static uint8_t rep[20];
     static uint8_t expect[] = {0x1, 0x86, 0x3, 0x76};
 
@@ -338,45 +471,1335 @@ static void testUserWriteError(void)
     testOk1(mbus_status==0);
 }
 
-static void runtests(int reset)
+static void testWriteMulti(void)
 {
+    uint8_t cmd[32] = {0x1, 0x10, 0x00, 0x10, 0x00, 0x3, 0x6,
+                       0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    size_t clen = add_crc(cmd, 13);
+    uint8_t expect[8] = {0x1, 0x10, 0x00, 0x10, 0x00, 0x3};
+    uint8_t rep[20];
 
-    mbus_reset();
+    add_crc(expect, 6);
+
+    testDiag("Testing write multiple holding registers (command 16)");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==0);
+
+    testOk1(read_counter==0);
+    testOk1(write_counter==0);
+    testOk1(write_multi_counter==1);
+    testOk1(write_multi_addr==0x0010);
+    testOk1(write_multi_count==3);
+    testOk1(write_multi_data[0]==0x1122);
+    testOk1(write_multi_data[1]==0x3344);
+    testOk1(write_multi_data[2]==0x5566);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testWriteMultiTruncated(void)
+{
+    uint8_t cmd[32] = {0x1, 0x10, 0x00, 0x10, 0x00, 0x3, 0x6,
+                       0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    size_t clen = add_crc(cmd, 13);
+
+    testDiag("Testing truncated command 16 followed by RX timeout");
+
+    write_multi_counter = 0;
+
+    // last register and CRC missing
+    testOk1(modbus_in_all(cmd, clen-4)==0);
     testOk1(mbus_status==0);
 
-    read_counter = write_counter = 0;
+    mbus_process(); // RX timeout
+    testOk1(mbus_status==0);
+    testOk1(write_multi_counter==0);
 
-    testRead();
+    testDiag("Make sure we can still process a valid message");
 
-    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
-    read_counter = write_counter = 0;
+    testWriteMulti();
+}
 
-    testWrite();
+static void testWriteMultiBadCount(void)
+{
+    // byte count does not match register count
+    uint8_t cmd[32] = {0x1, 0x10, 0x00, 0x10, 0x00, 0x3, 0x4,
+                       0x11, 0x22, 0x33, 0x44};
+    size_t clen = add_crc(cmd, 11);
+    static uint8_t rep[20];
+    static uint8_t expect[] = {0x1, 0x90, 0x3, 0x6C};
 
-    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
-    read_counter = write_counter = 0;
+    testDiag("Testing command 16 with inconsistent byte count");
 
-    testInvalidFunc();
+    write_multi_counter = 0;
 
-    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
-    read_counter = write_counter = 0;
+    testOk1(modbus_in_all(cmd, clen)==1);
 
-    testBadCRC();
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(write_multi_counter==0);
 
-    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
-    read_counter = write_counter = 0;
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
 
-    testUserReadError();
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
 
-    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
-    read_counter = write_counter = 0;
+static void testWriteMultiOverLength(void)
+{
+    uint8_t cmd[2*MAX_BUFFER+16] = {0x1, 0x10, 0x00, 0x10, 0x00, 1+MAX_BUFFER/2, 2+MAX_BUFFER};
+    size_t clen = add_crc(cmd, 7+2+MAX_BUFFER);
+    static uint8_t rep[20];
+    static uint8_t expect[] = {0x1, 0x90, 0x3, 0x6C};
 
-    testUserWriteError();
+    testDiag("Testing command 16 with too many registers");
+
+    write_multi_counter = 0;
+
+    // rejected as soon as the header is received
+    testOk1(modbus_in_all(cmd, clen)==1);
+
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(write_multi_counter==0);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
+
+static void testUserWriteMultiError(void)
+{
+    uint8_t cmd[32] = {0x1, 0x10, 0x00, 0x10, 0x00, 0x1, 0x2, 0x12, 0x34};
+    size_t clen = add_crc(cmd, 9);
+    static uint8_t rep[20];
+    static uint8_t expect[] = {0x1, 0x90, 0x3, 0x6C};
+
+    write_fail = 1;
+
+    testDiag("Testing user error on write multiple");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==1);
+
+    write_fail = 0;
+
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(write_multi_counter==1);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
+
+static void testReadWrite(void)
+{
+    uint8_t cmd[32] = {0x1, 0x17, 0x00, 0x01, 0x00, 0x2,
+                       0x00, 0x01, 0x00, 0x1, 0x2, 0xAB, 0xCD};
+    size_t clen = add_crc(cmd, 13);
+    uint8_t expect[9] = {0x1, 0x17, 0x4, 0x0, 0x1, 0x2, 0x3};
+    uint8_t rep[20];
+
+    add_crc(expect, 7);
+
+    testDiag("Testing read/write multiple registers (command 23)");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==0);
+
+    testOk1(write_counter==0);
+    testOk1(write_multi_counter==1);
+    testOk1(write_multi_addr==0x0001);
+    testOk1(write_multi_count==1);
+    testOk1(write_multi_data[0]==0xABCD);
+    testOk1(read_counter==1);
+    testOk1(read_addr==0x0001);
+    testOk1(read_count==2);
+    testOk(write_multi_seq<read_seq, "write before read");
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testReadWriteBadCount(void)
+{
+    // read count too large
+    uint8_t cmd[32] = {0x1, 0x17, 0x00, 0x01, 0x00, 1+MAX_BUFFER/2,
+                       0x00, 0x01, 0x00, 0x1, 0x2, 0xAB, 0xCD};
+    size_t clen = add_crc(cmd, 13);
+    static uint8_t rep[20];
+    static uint8_t expect[] = {0x1, 0x97, 0x3, 0x65};
+
+    testDiag("Testing command 23 with too many registers");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==1);
+
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(write_multi_counter==0);
+    testOk1(read_counter==0);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
+
+static void testUserReadWriteError(int wfail)
+{
+    uint8_t cmd[32] = {0x1, 0x17, 0x00, 0x01, 0x00, 0x2,
+                       0x00, 0x01, 0x00, 0x1, 0x2, 0xAB, 0xCD};
+    size_t clen = add_crc(cmd, 13);
+    static uint8_t rep[20];
+    uint8_t expect[] = {0x1, 0x97, 0x0, 0x0};
+
+    // write fails with 3, read fails with 2
+    expect[2] = wfail ? 3 : 2;
+    expect[3] = -(expect[0]+expect[1]+expect[2]);
+
+    write_fail = wfail;
+    read_fail = !wfail;
+
+    testDiag("Testing user %s error on read/write multiple",
+             wfail ? "write" : "read");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==1);
+
+    write_fail = read_fail = 0;
+
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(write_multi_counter==1);
+    // no read if the write fails
+    testOk1(read_counter==!wfail);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
+
+static void testReadBits(void)
+{
+    // discrete inputs 3 through 12
+    uint8_t cmd[8] = {0x1, 0x2, 0x00, 0x03, 0x00, 10};
+    uint8_t expect[7] = {0x1, 0x2, 0x2, 0x94, 0x03};
+    uint8_t rep[20];
+
+    add_crc(cmd, 6);
+    add_crc(expect, 5);
+
+    testDiag("Testing read discrete inputs (command 2)");
+
+    coil_read_counter = 0;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(coil_read_counter==1);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testWriteCoils(void)
+{
+    // coils 4 through 12 to 1 0110 0011
+    uint8_t cmd[11] = {0x1, 0xF, 0x00, 0x04, 0x00, 9, 2, 0x63, 0x01};
+    uint8_t expect[8] = {0x1, 0xF, 0x00, 0x04, 0x00, 9};
+    uint8_t rcmd[8] = {0x1, 0x1, 0x00, 0x00, 0x00, 16};
+    uint8_t rexpect[7] = {0x1, 0x1, 0x2, 0x30, 0x16};
+    uint8_t rep[20];
+
+    add_crc(cmd, 9);
+    add_crc(expect, 6);
+    add_crc(rcmd, 6);
+    add_crc(rexpect, 5);
+
+    testDiag("Testing write multiple coils (command 15)");
+
+    coils[0] = coils[1] = 0;
+    coil_read_counter = coil_write_counter = 0;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(coil_write_counter==1);
+    testOk1(coils[0]==0x30 && coils[1]==0x16);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    testDiag("Testing read coils (command 1)");
+
+    testOk1(modbus_in_all(rcmd, sizeof(rcmd))==0);
+    testOk1(coil_read_counter==1);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(rexpect))) {
+        testOk1(memcmp(rep, rexpect, sizeof(rexpect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testWriteCoil(void)
+{
+    uint8_t cmd[8] = {0x1, 0x5, 0x00, 0x09, 0xFF, 0x00};
+    uint8_t rep[20];
+
+    add_crc(cmd, 6);
+
+    testDiag("Testing write single coil (command 5)");
+
+    coils[0] = coils[1] = 0;
+    coil_write_counter = 0;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(coil_write_counter==1);
+    testOk1(coils[0]==0x00 && coils[1]==0x02);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(cmd))) {
+        testOk1(memcmp(rep, cmd, sizeof(cmd))==0);
+    } else
+        testFail("Sizes don't match");
+
+    cmd[4] = 0x00;
+    add_crc(cmd, 6);
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(coil_write_counter==2);
+    testOk1(coils[0]==0x00 && coils[1]==0x00);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(cmd))) {
+        testOk1(memcmp(rep, cmd, sizeof(cmd))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testWriteCoilInvalid(void)
+{
+    // only 0xFF00 and 0x0000 are valid
+    uint8_t cmd[8] = {0x1, 0x5, 0x00, 0x09, 0x12, 0x34};
+    static uint8_t rep[20];
+    static uint8_t expect[] = {0x1, 0x85, 0x3, 0x77};
+
+    add_crc(cmd, 6);
+
+    testDiag("Testing write single coil with invalid value");
+
+    coil_write_counter = 0;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==1);
+
+    testOk1(mbus_status==(MBUS_RX_ERROR|MBUS_TX_READY));
+    testOk1(coil_write_counter==0);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    mbus_status &= ~MBUS_RX_ERROR;
+    testOk1(mbus_status==0);
+}
+
+static void testReadFifo(void)
+{
+    uint8_t cmd[6] = {0x1, 0x18, 0x12, 0x34};
+    uint8_t bad[6] = {0x1, 0x18, 0x00, 0x00};
+    uint8_t rep[80];
+    uint8_t expect[14] = {0x1, 0x18, 0x00, 0x08, 0x00, 0x3, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    uint8_t expect0[8] = {0x1, 0x18, 0x00, 0x02, 0x00, 0x0};
+    static const uint8_t expect2[] = {0x1, 0x98, 0x2, 0x65};
+    size_t i, n;
+    int ok = 1;
+
+    add_crc(cmd, 4);
+    add_crc(bad, 4);
+    add_crc(expect, 12);
+    add_crc(expect0, 6);
+
+    testDiag("Testing read FIFO queue (command 24)");
+
+    fifo_q[0] = 0x1122;
+    fifo_q[1] = 0x3344;
+    fifo_q[2] = 0x5566;
+    fifo_n = 3;
+    fifo_counter = 0;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(fifo_counter==1 && fifo_max==MBUS_FIFO_MAX);
+    testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect));
+    testOk1(memcmp(rep, expect, sizeof(expect))==0);
+
+    // now empty
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect0));
+    testOk1(memcmp(rep, expect0, sizeof(expect0))==0);
+
+    testOk1(modbus_in_all(bad, sizeof(bad))==1);
+    testOk1(modbus_out_all(rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect2, 4)==0);
+    mbus_status &= ~MBUS_RX_ERROR;
+
+    // more than fit in one reply
+    for(i=0; i<40; i++)
+        fifo_q[i] = 0x100+i;
+    fifo_n = 40;
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    n = modbus_out_all(rep, sizeof(rep));
+    testOk(n==8+2*MBUS_FIFO_MAX, "reply length %zu", n);
+    testOk1(rep[2]==0 && rep[3]==2+2*MBUS_FIFO_MAX && rep[4]==0 && rep[5]==MBUS_FIFO_MAX);
+    for(i=0; i<MBUS_FIFO_MAX; i++)
+        ok &= rep[6+2*i]==0x01 && rep[7+2*i]==i;
+    testOk(ok, "FIFO values");
+    testOk(calculate_crc(rep, n-2)==(rep[n-2]|rep[n-1]<<8), "CRC");
+    testOk1(fifo_n==40-MBUS_FIFO_MAX);
+    fifo_n = 0;
+}
+
+static void testOtherUnit(void)
+{
+    uint8_t cmd[8] = {0x2, 0x6, 0x21, 0x43, 0x56, 0x78};
+
+    add_crc(cmd, 6);
+
+    testDiag("Testing request for another unit is ignored");
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+
+    testOk1(mbus_status==0);
+    testOk1(write_counter==0);
+
+    mbus_process(); // RX timeout
+    testOk1(mbus_status==0);
+
+    testDiag("Make sure we can still process a valid message");
+
+    testWrite();
+
+    testDiag("Testing changing unit address");
+
+    mbus_set_unit(2);
+    testOk1(mbus_get_unit()==2);
+
+    write_counter = 0;
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+    testOk1(write_counter==1);
+    testOk1(mbus_status==MBUS_TX_READY);
+    {
+        uint8_t rep[20];
+        if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(cmd))) {
+            testOk1(memcmp(rep, cmd, sizeof(cmd))==0);
+        } else
+            testFail("Sizes don't match");
+    }
+
+    mbus_set_unit(1);
+}
+
+static void testBroadcast(void)
+{
+    uint8_t cmd[8] = {0x0, 0x6, 0x21, 0x43, 0x56, 0x78};
+    uint8_t rcmd[8] = {0x0, 0x3, 0x12, 0x34, 0x00, 0x4};
+
+    add_crc(cmd, 6);
+    add_crc(rcmd, 6);
+
+    testDiag("Testing broadcast write is applied without reply");
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+
+    testOk1(mbus_status==0);
+    testOk1(write_counter==1);
+    testOk1(write_data==0x5678);
+
+    testDiag("Testing broadcast read is ignored");
+
+    testOk1(modbus_in_all(rcmd, sizeof(rcmd))==0);
+
+    testOk1(mbus_status==0);
+    testOk1(read_counter==0);
+
+    mbus_process(); // RX timeout
+    testOk1(mbus_status==0);
+
+    testDiag("Make sure we can still process a valid message");
+
+    write_counter = 0;
+    testWrite();
+}
+
+static void testSkipFrames(void)
+{
+    struct instance A = {{0x1234, 0x5678}};
+    struct mbus_ctx ctx;
+    uint8_t other[8] = {0x2, 0x3, 0x00, 0x00, 0x00, 0x2};
+    uint8_t otherrep[9] = {0x2, 0x3, 0x4, 0xAA, 0xBB, 0xCC, 0xDD};
+    uint8_t otherexc[4] = {0x2, 0x83, 0x2, (uint8_t)-(0x2+0x83+0x2)};
+    uint8_t bcast[8] = {0x0, 0x3, 0x00, 0x00, 0x00, 0x2};
+    uint8_t cmd[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 0x2};
+    uint8_t expect[9] = {0x1, 0x3, 0x4, 0x12, 0x34, 0x56, 0x78};
+    uint8_t rep[20];
+    size_t i, n = 0;
+    int ok = 1, b;
+
+    add_crc(other, 6);
+    add_crc(otherrep, 7);
+    add_crc(bcast, 6);
+    add_crc(cmd, 6);
+    add_crc(expect, 7);
+
+    testDiag("Testing end of skipped frames is found without RX timeout");
+
+    mbus_ctx_init(&ctx, &inst_ops, &A);
+
+    for(i=0; i<sizeof(other); i++)
+        ok &= !ctx_in(&ctx, other[i]);
+    for(i=0; i<sizeof(otherrep); i++)
+        ok &= !ctx_in(&ctx, otherrep[i]);
+    for(i=0; i<sizeof(otherexc); i++)
+        ok &= !ctx_in(&ctx, otherexc[i]);
+    for(i=0; i<sizeof(bcast); i++)
+        ok &= !ctx_in(&ctx, bcast[i]);
+    testOk(ok, "other frames accepted");
+    testOk1(ctx.status==0 && A.nread==0);
+
+    ok = 1;
+    for(i=0; i<sizeof(cmd); i++)
+        ok &= !ctx_in(&ctx, cmd[i]);
+    testOk(ok, "request accepted");
+    testOk1(A.nread==1);
+
+    while((b=ctx_out(&ctx))>=0 && n<sizeof(rep))
+        rep[n++] = b;
+
+    if(testOk1(n==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+
+    testOk1(ctx.diag.bus_msg==5);
+    testOk1(ctx.diag.server_msg==1);
+}
+
+static void testInterleaved(void)
+{
+    struct instance A = {{0}}, B = {{0x1234, 0x5678}};
+    struct mbus_ctx ctxA, ctxB;
+    uint8_t cmdA[8] = {0x1, 0x6, 0x00, 0x02, 0xAB, 0xCD};
+    uint8_t cmdB[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 0x2};
+    uint8_t expectB[9] = {0x1, 0x3, 0x4, 0x12, 0x34, 0x56, 0x78};
+    uint8_t repA[20], repB[20];
+    size_t i, nA = 0, nB = 0;
+    int ok = 1;
+
+    add_crc(cmdA, 6);
+    add_crc(cmdB, 6);
+    add_crc(expectB, 7);
+
+    testDiag("Testing two instances with interleaved bytes");
+
+    mbus_ctx_init(&ctxA, &inst_ops, &A);
+    mbus_ctx_init(&ctxB, &inst_ops, &B);
+
+    for(i=0; i<8; i++) {
+        ok &= !ctx_in(&ctxA, cmdA[i]);
+        ok &= !ctx_in(&ctxB, cmdB[i]);
+    }
+    testOk(ok, "all bytes accepted");
+
+    testOk1(A.nwrite==1 && A.nread==0);
+    testOk1(B.nwrite==0 && B.nread==1);
+    testOk1(A.regs[2]==0xABCD);
+
+    while(1) {
+        int a = ctx_out(&ctxA), b = ctx_out(&ctxB);
+        if(a<0 && b<0)
+            break;
+        if(a>=0 && nA<sizeof(repA))
+            repA[nA++] = a;
+        if(b>=0 && nB<sizeof(repB))
+            repB[nB++] = b;
+    }
+
+    if(testOk1(nA==sizeof(cmdA))) {
+        testOk1(memcmp(repA, cmdA, sizeof(cmdA))==0);
+    } else
+        testFail("Sizes don't match");
+
+    if(testOk1(nB==sizeof(expectB))) {
+        testOk1(memcmp(repB, expectB, sizeof(expectB))==0);
+    } else
+        testFail("Sizes don't match");
+
+    testOk1(ctxA.status==0 && ctxB.status==0);
+    testOk1(mbus_status==0);
+}
+
+static void testManyInstances(void)
+{
+#define NINST 100
+    static struct instance inst[NINST];
+    static struct mbus_ctx ctx[NINST];
+    uint8_t cmd[NINST][8];
+    size_t i, j;
+    unsigned nbad = 0;
+
+    testDiag("Testing %u instances with interleaved bytes", NINST);
+
+    memset(inst, 0, sizeof(inst));
+
+    for(i=0; i<NINST; i++) {
+        mbus_ctx_init(&ctx[i], &inst_ops, &inst[i]);
+        mbus_ctx_set_unit(&ctx[i], 1+i);
+        // write register i%8 with 0x100+i
+        cmd[i][0] = 1+i;
+        cmd[i][1] = 6;
+        cmd[i][2] = 0;
+        cmd[i][3] = i%8;
+        cmd[i][4] = 1;
+        cmd[i][5] = i;
+        add_crc(cmd[i], 6);
+    }
+
+    for(j=0; j<8; j++) {
+        for(i=0; i<NINST; i++)
+            nbad += ctx_in(&ctx[i], cmd[i][j]);
+    }
+    testOk(nbad==0, "all bytes accepted");
+
+    // replies, round robin
+    for(j=0; j<8; j++) {
+        for(i=0; i<NINST; i++) {
+            if(ctx_out(&ctx[i])!=cmd[i][j])
+                nbad++;
+        }
+    }
+    testOk(nbad==0, "all replies match");
+
+    for(i=0; i<NINST; i++) {
+        if(inst[i].nwrite!=1 || inst[i].regs[i%8]!=0x100+i || ctx[i].status!=0)
+            nbad++;
+    }
+    testOk(nbad==0, "all writes applied");
+#undef NINST
+}
+
+static void testInstanceNoHook(void)
+{
+    struct instance A = {{0}};
+    struct mbus_ctx ctxA;
+    uint8_t cmd[8] = {0x1, 0x1, 0x00, 0x00, 0x00, 0x8};
+    static uint8_t expect[] = {0x1, 0x81, 0x1, 0x7D};
+    uint8_t rep[20];
+    size_t n = 0;
+    int data;
+
+    add_crc(cmd, 6);
+
+    testDiag("Testing instance without coil hooks");
+
+    mbus_ctx_init(&ctxA, &inst_ops, &A);
+
+    testOk1(ctx_in(&ctxA, cmd[0])==0);
+    testOk1(ctx_in(&ctxA, cmd[1])==0);
+    testOk1(ctxA.status==(MBUS_RX_ERROR|MBUS_TX_READY));
+
+    while((data=ctx_out(&ctxA))>=0 && n<sizeof(rep))
+        rep[n++] = data;
+
+    if(testOk1(n==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+/* Pass a byte stream through the byte at a time API,
+ * collecting all reply bytes.  RX timeout between frames.
+ */
+static size_t stream_bytes(struct mbus_ctx *ctx, const uint8_t *cmd, const size_t *lens, size_t nframes,
+                           uint8_t *out, size_t omax)
+{
+    size_t f, i, n = 0;
+    int data;
+
+    for(f=0; f<nframes; f++) {
+        for(i=0; i<lens[f]; i++) {
+            while((data=ctx_out(ctx))>=0 && n<omax)
+                out[n++] = data;
+            ctx->in_byte = *cmd++;
+            ctx->status |= MBUS_RX_READY;
+            mbus_ctx_process(ctx);
+        }
+        while((data=ctx_out(ctx))>=0 && n<omax)
+            out[n++] = data;
+        ctx->status &= ~MBUS_RX_ERROR;
+        mbus_ctx_process(ctx);
+    }
+    return n;
+}
+
+// As stream_bytes() with feed and drain in chunks
+static size_t stream_feed(struct mbus_ctx *ctx, const uint8_t *cmd, const size_t *lens, size_t nframes,
+                          uint8_t *out, size_t omax, uint8_t chunk, uint8_t dmax)
+{
+    size_t f, n = 0;
+
+    for(f=0; f<nframes; f++) {
+        size_t pos = 0;
+        while(pos<lens[f]) {
+            size_t want = lens[f]-pos;
+            pos += mbus_ctx_feed(ctx, cmd+pos, want<chunk ? want : chunk);
+            while(ctx->status&MBUS_TX_READY && n<omax) {
+                size_t room = omax-n;
+                n += mbus_ctx_drain(ctx, out+n, room<dmax ? room : dmax);
+            }
+        }
+        cmd += lens[f];
+        ctx->status &= ~MBUS_RX_ERROR;
+        mbus_ctx_process(ctx);
+    }
+    return n;
+}
+
+static void testFeedDrain(void)
+{
+    // write, read, read out of range, bad CRC, unsupported function, other unit, read
+    uint8_t cmd[7][8] = {
+        {0x1, 0x6, 0x00, 0x03, 0x12, 0x34},
+        {0x1, 0x3, 0x00, 0x00, 0x00, 0x5},
+        {0x1, 0x3, 0x00, 0x06, 0x00, 0x5},
+        {0x1, 0x6, 0x00, 0x01, 0x55, 0x55, 0x00, 0x00},
+        {0x1, 0x1, 0x00, 0x00, 0x00, 0x8},
+        {0x2, 0x6, 0x00, 0x01, 0xAA, 0xAA},
+        {0x1, 0x3, 0x00, 0x02, 0x00, 0x3},
+    };
+    static const size_t lens[7] = {8, 8, 8, 8, 8, 8, 8};
+    static const uint8_t chunks[] = {1, 2, 3, 7, 255};
+    static const uint8_t dmaxs[] = {1, 4, 255};
+    struct instance A = {{0}}, B;
+    struct mbus_ctx ctxA, ctxB;
+    uint8_t expect[128], rep[128];
+    size_t nexpect, i, j;
+
+    for(i=0; i<7; i++) {
+        if(i!=3)
+            add_crc(cmd[i], 6);
+    }
+
+    testDiag("Testing mbus_ctx_feed() and mbus_ctx_drain() against byte at a time");
+
+    mbus_ctx_init(&ctxA, &inst_ops, &A);
+    nexpect = stream_bytes(&ctxA, cmd[0], lens, 7, expect, sizeof(expect));
+    // replies to write, read, exception 2, exception 4, exception 1, read
+    testOk(nexpect==8+15+4+4+4+11, "reply bytes %zu", nexpect);
+    testOk1(A.regs[3]==0x1234);
+
+    for(i=0; i<sizeof(chunks); i++) {
+        for(j=0; j<sizeof(dmaxs); j++) {
+            size_t n;
+            memset(&B, 0, sizeof(B));
+            memset(rep, 0, sizeof(rep));
+            mbus_ctx_init(&ctxB, &inst_ops, &B);
+
+            n = stream_feed(&ctxB, cmd[0], lens, 7, rep, sizeof(rep), chunks[i], dmaxs[j]);
+
+            testOk(n==nexpect && memcmp(rep, expect, n)==0 && memcmp(A.regs, B.regs, sizeof(A.regs))==0
+                   && ctxB.status==0,
+                   "chunk %u, drain %u", chunks[i], dmaxs[j]);
+        }
+    }
+
+    // feed stops at the end of a request, with a reply ready
+    memset(&B, 0, sizeof(B));
+    mbus_ctx_init(&ctxB, &inst_ops, &B);
+    testOk1(mbus_ctx_feed(&ctxB, cmd[0], 16)==8);
+    testOk1(ctxB.status==MBUS_TX_READY);
+    testOk1(mbus_ctx_feed(&ctxB, cmd[1], 8)==0);
+    testOk1(mbus_ctx_drain(&ctxB, rep, 3)==3);
+    testOk1(ctxB.status==MBUS_TX_READY);
+    testOk1(mbus_ctx_drain(&ctxB, rep+3, sizeof(rep)-3)==5);
+    testOk1(memcmp(rep, cmd[0], 8)==0);
+    testOk1(ctxB.status==0);
+    testOk1(mbus_ctx_drain(&ctxB, rep, sizeof(rep))==0);
+    testOk1(mbus_ctx_feed(&ctxB, cmd[1], 8)==8);
+    testOk1(mbus_ctx_drain(&ctxB, rep, sizeof(rep))==15);
+}
+
+// send a request to an instance, and collect the reply
+static size_t ctx_transact(struct mbus_ctx *ctx, const uint8_t *cmd, size_t clen,
+                           uint8_t *rep, size_t rmax)
+{
+    size_t i, n = 0;
+    int data;
+
+    for(i=0; i<clen; i++)
+        ctx_in(ctx, cmd[i]);
+    while((data=ctx_out(ctx))>=0 && n<rmax)
+        rep[n++] = data;
+    ctx->status &= ~MBUS_RX_ERROR;
+    return n;
+}
+
+static void testStreamRead(void)
+{
+    struct instance A = {{0x1234, 0x5678, 0x9abc, 0xdef0, 0x0102}};
+    struct mbus_ctx ctxA;
+    uint8_t cmd[8] = {0x1, 0x3, 0x00, 0x01, 0x00, 0x3};
+    uint8_t expect[11] = {0x1, 0x3, 0x6, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0};
+    uint8_t rep[20];
+    size_t i, n = 0;
+    int data;
+
+    add_crc(cmd, 6);
+    add_crc(expect, 9);
+
+    testDiag("Testing streaming read");
+
+    mbus_ctx_init(&ctxA, &inst_stream_ops, &A);
+    stream_nbegin = stream_nreg = 0;
+
+    for(i=0; i<sizeof(cmd); i++)
+        ctx_in(&ctxA, cmd[i]);
+
+    // nothing read until sent
+    testOk1(ctxA.status==MBUS_TX_READY);
+    testOk1(stream_nbegin==1);
+    testOk1(stream_nreg==0);
+
+    for(i=0; i<4; i++)
+        rep[n++] = ctx_out(&ctxA);
+    // node, function, count, and the first register high byte
+    testOk1(stream_nreg==1);
+
+    while((data=ctx_out(&ctxA))>=0 && n<sizeof(rep))
+        rep[n++] = data;
+
+    testOk1(stream_nreg==3);
+    if(testOk1(n==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+    testOk1(ctxA.status==0);
+}
+
+static void testStreamErrors(void)
+{
+    struct instance A = {{0}};
+    struct mbus_ctx ctxA;
+    uint8_t cmd[8] = {0x1, 0x3, 0x00, 0x06, 0x00, 0x3};
+    uint8_t zero[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 0x0};
+    uint8_t over[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 126};
+    uint8_t rw[15] = {0x1, 0x17, 0x00, 0x00, 0x00, 0x1, 0x00, 0x00, 0x00, 0x1, 0x2, 0x12, 0x34};
+    static const uint8_t expect2[] = {0x1, 0x83, 0x2, 0x7A};
+    static const uint8_t expect3[] = {0x1, 0x83, 0x3, 0x79};
+    static const uint8_t expect1[] = {0x1, 0x97, 0x1, 0x67};
+    uint8_t rep[20];
+
+    add_crc(cmd, 6);
+    add_crc(zero, 6);
+    add_crc(over, 6);
+    add_crc(rw, 13);
+
+    testDiag("Testing streaming read errors");
+
+    mbus_ctx_init(&ctxA, &inst_stream_ops, &A);
+    stream_nbegin = stream_nreg = 0;
+
+    // rejected by stream_begin
+    testOk1(ctx_transact(&ctxA, cmd, sizeof(cmd), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect2, 4)==0);
+    testOk1(stream_nbegin==1 && stream_nreg==0);
+
+    testOk1(ctx_transact(&ctxA, zero, sizeof(zero), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect3, 4)==0);
+
+    testOk1(ctx_transact(&ctxA, over, sizeof(over), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect3, 4)==0);
+    testOk1(stream_nbegin==1 && stream_nreg==0);
+
+    // function 23 needs read_holding
+    testOk1(ctx_transact(&ctxA, rw, 2, rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect1, 4)==0);
+    mbus_ctx_process(&ctxA); // RX timeout
+}
+
+static void testRegmap(void)
+{
+    struct mbus_ctx ctxA;
+    uint8_t rd[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 0x5};
+    uint8_t wr[8] = {0x1, 0x6, 0x00, 0x02, 0x12, 0x34};
+    uint8_t wm[13] = {0x1, 0x10, 0x00, 0x02, 0x00, 0x2, 0x4, 0xAB, 0xCD, 0x55, 0xAA};
+    uint8_t rw[15] = {0x1, 0x17, 0x00, 0x02, 0x00, 0x2, 0x00, 0x00, 0x00, 0x1, 0x2, 0x0F, 0xF0};
+    uint8_t expect[15] = {0x1, 0x3, 10, 0x11, 0x11, 0x22, 0x22, 0x33, 0x33, 0x44, 0x44, 0x40, 0x00};
+    uint8_t expectrw[9] = {0x1, 0x17, 4, 0x33, 0xCD, 0x55, 0xAA};
+    uint8_t rep[20];
+
+    add_crc(rd, 6);
+    add_crc(wr, 6);
+    add_crc(wm, 11);
+    add_crc(rw, 13);
+    add_crc(expect, 13);
+    add_crc(expectrw, 9-2);
+
+    testDiag("Testing register map");
+
+    mbus_ctx_init(&ctxA, &map_ops, NULL);
+    mbus_ctx_set_regmap(&ctxA, test_map, 7);
+    map_r[0] = 0x1111;
+    map_r[1] = 0x2222;
+    map_r[2] = 0x3333;
+    map_r[3] = 0x4444;
+    map_nread = map_nwrite = map_nbegin = 0;
+
+    // plain storage, and a read handler
+    testOk1(ctx_transact(&ctxA, rd, sizeof(rd), rep, sizeof(rep))==15);
+    testOk1(memcmp(rep, expect, 15)==0);
+    testOk1(map_nread==1 && map_nbegin==1);
+
+    // only the low byte is writable.  Reply echoes the request
+    testOk1(ctx_transact(&ctxA, wr, sizeof(wr), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, wr, 8)==0);
+    testOk1(map_r[2]==0x3334);
+
+    // plain store, then handler
+    testOk1(ctx_transact(&ctxA, wm, sizeof(wm), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, wm, 6)==0);
+    testOk1(map_r[2]==0x33CD && map_r[3]==0x55AA);
+    testOk1(map_nwrite==1);
+
+    testOk1(ctx_transact(&ctxA, rw, sizeof(rw), rep, sizeof(rep))==9);
+    testOk1(memcmp(rep, expectrw, 9)==0);
+    testOk1(map_r[0]==0x0FF0);
+    testOk1(map_nbegin==2);
+
+    testOk1(mbus_ctx_write_reg(&ctxA, 6, 0x1234)==0);
+    testOk1(map_r[6]==0x1234);
+    testOk1(mbus_ctx_write_reg(&ctxA, 1, 0x1234)==0); // read only, ignored
+    testOk1(mbus_ctx_write_reg(&ctxA, 5, 0x1234)==2);
+    testOk1(mbus_ctx_write_reg(&ctxA, 3, 0xDEAD)==3);
+    testOk1(map_r[1]==0x2222 && map_r[3]==0x55AA);
+    mbus_ctx_reset(&ctxA);
+}
+
+static void testRegmapErrors(void)
+{
+    struct mbus_ctx ctxA;
+    uint8_t hole[8] = {0x1, 0x3, 0x00, 0x04, 0x00, 0x2};
+    uint8_t wonly[8] = {0x1, 0x3, 0x00, 0x06, 0x00, 0x1};
+    uint8_t past[8] = {0x1, 0x3, 0x00, 0x06, 0x00, 0x2};
+    uint8_t ro[8] = {0x1, 0x6, 0x00, 0x01, 0x12, 0x34};
+    uint8_t wm[13] = {0x1, 0x10, 0x00, 0x00, 0x00, 0x2, 0x4, 0x12, 0x34, 0x56, 0x78};
+    uint8_t bad[13] = {0x1, 0x10, 0x00, 0x02, 0x00, 0x2, 0x4, 0x12, 0x34, 0xDE, 0xAD};
+    uint8_t wh[15] = {0x1, 0x10, 0x00, 0x03, 0x00, 0x3, 0x6, 0x11, 0x11, 0x22, 0x22, 0x33, 0x33};
+    static const uint8_t expect3[] = {0x1, 0x83, 0x2, 0x7A};
+    static const uint8_t expect6[] = {0x1, 0x86, 0x2, 0x77};
+    static const uint8_t expect16[] = {0x1, 0x90, 0x2, 0x6D};
+    static const uint8_t expect16u[] = {0x1, 0x90, 0x3, 0x6C};
+    uint8_t rep[20];
+
+    add_crc(hole, 6);
+    add_crc(wonly, 6);
+    add_crc(past, 6);
+    add_crc(ro, 6);
+    add_crc(wm, 11);
+    add_crc(bad, 11);
+    add_crc(wh, 13);
+
+    testDiag("Testing register map errors");
+
+    mbus_ctx_init(&ctxA, &map_ops, NULL);
+    mbus_ctx_set_regmap(&ctxA, test_map, 7);
+    map_r[0] = 0x1111;
+    map_r[1] = 0x2222;
+    map_r[2] = 0x3333;
+    map_r[3] = 0x4444;
+    map_nread = map_nwrite = map_nbegin = 0;
+
+    testOk1(ctx_transact(&ctxA, hole, sizeof(hole), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect3, 4)==0);
+    testOk1(ctx_transact(&ctxA, wonly, sizeof(wonly), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect3, 4)==0);
+    testOk1(ctx_transact(&ctxA, past, sizeof(past), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect3, 4)==0);
+    testOk1(map_nread==0 && map_nbegin==0);
+
+    // writes to read only registers are ignored
+    testOk1(ctx_transact(&ctxA, ro, sizeof(ro), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, ro, 8)==0);
+    testOk1(map_r[1]==0x2222);
+
+    testOk1(ctx_transact(&ctxA, wm, sizeof(wm), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, wm, 6)==0);
+    testOk1(map_r[0]==0x1234 && map_r[1]==0x2222);
+
+    // whole range is checked before anything is written
+    testOk1(ctx_transact(&ctxA, wh, sizeof(wh), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect16, 4)==0);
+    testOk1(map_r[3]==0x4444 && map_nwrite==0);
+
+    // handler exception stops the write
+    testOk1(ctx_transact(&ctxA, bad, sizeof(bad), rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect16u, 4)==0);
+    testOk1(map_r[2]==0x3334 && map_r[3]==0x4444);
+    testOk1(map_nwrite==1);
+
+    // without a map, the hooks are used
+    mbus_ctx_set_regmap(&ctxA, NULL, 7);
+    testOk1(ctxA.nregs==0);
+    testOk1(ctx_transact(&ctxA, ro, 2, rep, sizeof(rep))==4);
+    testOk1(memcmp(rep, expect6, 2)==0 && rep[2]==1);
+    mbus_ctx_process(&ctxA); // RX timeout
+}
+
+// function 8 request.  Returns reply length, and data of a normal reply
+static size_t diag_query(struct mbus_ctx *ctx, uint8_t node, uint16_t sub, uint16_t data,
+                         uint8_t *rep, uint16_t *value)
+{
+    uint8_t cmd[8] = {node, 0x8, sub>>8, sub, data>>8, data};
+    size_t n;
+
+    add_crc(cmd, 6);
+    n = ctx_transact(ctx, cmd, sizeof(cmd), rep, 8);
+    if(n==8 && memcmp(rep, cmd, 4)==0 && calculate_crc(rep, 6)==(rep[6]|rep[7]<<8))
+        *value = rep[4]<<8 | rep[5];
+    else
+        *value = 0xffff;
+    return n;
+}
+
+static void testDiagnostics(void)
+{
+    struct instance A = {{0}};
+    struct mbus_ctx ctxA;
+    uint8_t wr[8] = {0x1, 0x6, 0x00, 0x00, 0x12, 0x34};
+    uint8_t other[8] = {0x2, 0x3, 0x00, 0x00, 0x00, 0x1};
+    uint8_t badcrc[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 0x1, 0xFF, 0xFF};
+    uint8_t bcast[8] = {0x0, 0x6, 0x00, 0x01, 0x56, 0x78};
+    uint8_t badfn[2] = {0x1, 0x41};
+    uint8_t events[4] = {0x1, 0xB};
+    uint8_t expect_ev[8] = {0x1, 0xB, 0x00, 0x00, 0x00, 9};
+    uint8_t expect_exc1[4] = {0x1, 0x88, 0x1, 0x76};
+    uint8_t expect_exc3[4] = {0x1, 0x88, 0x3, 0x74};
+    uint8_t rep[20];
+    uint16_t val;
+
+    add_crc(wr, 6);
+    add_crc(other, 6);
+    add_crc(bcast, 6);
+    add_crc(events, 2);
+    add_crc(expect_ev, 6);
+
+    testDiag("Testing diagnostic counters, and functions 8 and 11");
+
+    mbus_ctx_init(&ctxA, &inst_ops, &A);
+
+    testOk1(ctx_transact(&ctxA, wr, sizeof(wr), rep, sizeof(rep))==8);
+    testOk1(ctx_transact(&ctxA, other, sizeof(other), rep, sizeof(rep))==0);
+    mbus_ctx_process(&ctxA); // RX timeout
+    testOk1(ctx_transact(&ctxA, badcrc, sizeof(badcrc), rep, sizeof(rep))==4);
+    testOk1(ctx_transact(&ctxA, bcast, sizeof(bcast), rep, sizeof(rep))==0);
+    testOk1(A.regs[1]==0x5678);
+    testOk1(ctx_transact(&ctxA, badfn, sizeof(badfn), rep, sizeof(rep))==4);
+    mbus_ctx_process(&ctxA); // RX timeout
+    ctxA.diag.framing = 3;
+
+    // each query is itself counted
+    testOk1(diag_query(&ctxA, 1, 0x0B, 0, rep, &val)==8 && val==6);
+    testOk1(diag_query(&ctxA, 1, 0x0C, 0, rep, &val)==8 && val==1);
+    testOk1(diag_query(&ctxA, 1, 0x0D, 0, rep, &val)==8 && val==2);
+    testOk1(diag_query(&ctxA, 1, 0x0E, 0, rep, &val)==8 && val==7);
+    testOk1(diag_query(&ctxA, 1, 0x0F, 0, rep, &val)==8 && val==1);
+    testOk1(diag_query(&ctxA, 1, 0x64, 0, rep, &val)==8 && val==3);
+    testOk1(diag_query(&ctxA, 1, 0x00, 0xA55A, rep, &val)==8 && val==0xA55A);
+
+    // exceptions and successful writes don't count, function 8 does
+    testOk1(ctx_transact(&ctxA, events, sizeof(events), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, expect_ev, 8)==0);
+    testOk1(ctx_transact(&ctxA, events, sizeof(events), rep, sizeof(rep))==8);
+    testOk1(memcmp(rep, expect_ev, 8)==0);
+
+    testOk1(diag_query(&ctxA, 1, 0x0B, 1, rep, &val)==4);
+    testOk1(memcmp(rep, expect_exc3, 4)==0);
+    testOk1(diag_query(&ctxA, 1, 0x99, 0, rep, &val)==4);
+    testOk1(memcmp(rep, expect_exc1, 4)==0);
+    // never answered
+    testOk1(diag_query(&ctxA, 0, 0x0B, 0, rep, &val)==0);
+    mbus_ctx_process(&ctxA); // RX timeout
+
+    testOk1(diag_query(&ctxA, 1, 0x0A, 0, rep, &val)==8 && val==0);
+    testOk1(ctxA.diag.framing==0 && ctxA.diag.no_resp==0);
+    testOk1(diag_query(&ctxA, 1, 0x0B, 0, rep, &val)==8 && val==1);
+    testOk1(diag_query(&ctxA, 1, 0x0D, 0, rep, &val)==8 && val==0);
+}
+
+static void testStreamFull(void)
+{
+    struct mbus_ctx ctxA;
+    uint8_t cmd[8] = {0x1, 0x3, 0x10, 0x00, 0x00, 125};
+    uint8_t rep[260], feedrep[260];
+    size_t n, i;
+    int ok = 1;
+
+    add_crc(cmd, 6);
+
+    testDiag("Testing streaming read of 125 registers with MAX_BUFFER=%u", MAX_BUFFER);
+
+    mbus_ctx_init(&ctxA, &gen_stream_ops, NULL);
+    stream_nreg = 0;
+
+    n = ctx_transact(&ctxA, cmd, sizeof(cmd), rep, sizeof(rep));
+
+    testOk(n==255, "reply length %zu", n);
+    testOk1(stream_nreg==125);
+    testOk1(rep[0]==1 && rep[1]==3 && rep[2]==250);
+    for(i=0; i<125; i++) {
+        uint16_t expect = (0x1000+i)^0xA55A;
+        ok &= rep[3+2*i]==expect>>8 && rep[4+2*i]==(expect&0xff);
+    }
+    testOk(ok, "register values");
+    testOk(calculate_crc(rep, 253)==(rep[253]|rep[254]<<8), "CRC");
+
+    // same through feed and drain
+    testOk1(mbus_ctx_feed(&ctxA, cmd, sizeof(cmd))==sizeof(cmd));
+    testOk1(mbus_ctx_drain(&ctxA, feedrep, 100)==100);
+    testOk1(mbus_ctx_drain(&ctxA, feedrep+100, 200)==155);
+    testOk1(memcmp(rep, feedrep, 255)==0);
+}
+
+#if MAX_BUFFER>=250
+static void testReadFull(void)
+{
+    uint8_t cmd[8] = {0x1, 0x3, 0x00, 0x00, 0x00, 125};
+    uint8_t expect[255] = {0x1, 0x3, 250};
+    uint8_t rep[300];
+    size_t i;
+
+    for(i=0; i<250; i++)
+        expect[3+i] = i;
+    add_crc(cmd, 6);
+    add_crc(expect, 253);
+
+    testDiag("Testing full size read of 125 registers");
+
+    testOk1(modbus_in_all(cmd, sizeof(cmd))==0);
+
+    testOk1(read_counter==1);
+    testOk1(read_count==125);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+
+static void testWriteMultiFull(void)
+{
+    uint8_t cmd[255] = {0x1, 0x10, 0x00, 0x00, 0x00, 123, 246};
+    uint8_t expect[8] = {0x1, 0x10, 0x00, 0x00, 0x00, 123};
+    uint8_t rep[20];
+    size_t i, clen;
+
+    for(i=0; i<246; i++)
+        cmd[7+i] = i;
+    clen = add_crc(cmd, 253);
+    add_crc(expect, 6);
+
+    testDiag("Testing full size write of 123 registers");
+
+    write_multi_counter = 0;
+
+    testOk1(modbus_in_all(cmd, clen)==0);
+
+    testOk1(write_multi_counter==1);
+    testOk1(write_multi_count==123);
+    testOk1(write_multi_data[0]==0x0001);
+    testOk1(write_multi_data[122]==0xF4F5);
+
+    if(testOk1(modbus_out_all(rep, sizeof(rep))==sizeof(expect))) {
+        testOk1(memcmp(rep, expect, sizeof(expect))==0);
+    } else
+        testFail("Sizes don't match");
+}
+#endif
+
+static void runtests(int reset)
+{
+
+    mbus_reset();
+    testOk1(mbus_status==0);
+
+    read_counter = write_counter = 0;
+
+    testRead();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWrite();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testInvalidFunc();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testBadCRC();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testUserReadError();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testUserWriteError();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteMulti();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteMultiTruncated();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteMultiBadCount();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteMultiOverLength();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testUserWriteMultiError();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testReadWrite();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testReadWriteBadCount();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testUserReadWriteError(1);
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testUserReadWriteError(0);
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testReadBits();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteCoils();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteCoil();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteCoilInvalid();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testReadFifo();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testOtherUnit();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testBroadcast();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testSkipFrames();
+    testInterleaved();
+    testManyInstances();
+    testInstanceNoHook();
+    testFeedDrain();
+    testStreamRead();
+    testStreamErrors();
+    testStreamFull();
+    testRegmap();
+    testRegmapErrors();
+    testDiagnostics();
+
+#if MAX_BUFFER>=250
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testReadFull();
+
+    if(reset) {mbus_reset(); testOk1(mbus_status==0);}
+    read_counter = write_counter = 0;
+
+    testWriteMultiFull();
+#endif
 }
 
 int main(int argc, char** argv)
 {
-    testPlan(119);
+#if MAX_BUFFER>=250
+    testPlan(770);
+#else
+    testPlan(744);
+#endif
 
     testDiag("run and reset state between tests");
     runtests(1);
@@ -0,0 +1,94 @@
+/** Test of RTU frame length and check helpers
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rtu.h"
+#include "testutil.h"
+
+#define NELEMENTS(X) (sizeof(X)/sizeof(*(X)))
+
+// first n bytes of a reply, and the expected result of rtu_reply_len()
+static const struct {
+    const char *name;
+    uint8_t frame[12];
+    uint8_t n;
+    int len;
+} replies[] = {
+    {"too short",               {0x01}, 1, 0},
+    {"function 3 no count",     {0x01, 0x03}, 2, 0},
+    {"function 3",              {0x01, 0x03, 0x04}, 3, 9},
+    {"function 6",              {0x01, 0x06}, 2, 8},
+    {"function 11",             {0x01, 0x0B}, 2, 8},
+    {"function 24",             {0x01, 0x18, 0x00, 0x06}, 4, 12},
+    {"unknown function",        {0x01, 0x41}, 2, -1},
+    {"exception, 3 bytes",      {0x01, 0x83, 0x02}, 3, 0},
+    // exception code 2, from unit 1.  Standard CRC form, and mbus.c LRC form
+    {"CRC exception, 4 bytes",  {0x01, 0x83, 0x02, 0xC0}, 4, 5},
+    {"CRC exception",           {0x01, 0x83, 0x02, 0xC0, 0xF1}, 5, 5},
+    {"LRC exception",           {0x01, 0x83, 0x02, 0x7A}, 4, 4},
+    {"LRC exception, and more", {0x01, 0x83, 0x02, 0x7A, 0x01}, 5, 4},
+    // unit 6.  The LRC test also passes on the first 4 bytes of the CRC form
+    {"CRC exception like LRC",  {0x06, 0x86, 0x02, 0x72, 0x60}, 5, 5},
+    {"CRC exception like LRC, 4 bytes", {0x06, 0x86, 0x02, 0x72}, 4, 4},
+};
+
+static void testReplyLen(void)
+{
+    size_t i;
+
+    testDiag("Testing rtu_reply_len()");
+
+    for(i=0; i<NELEMENTS(replies); i++) {
+        int len = rtu_reply_len(replies[i].frame, replies[i].n);
+        testOk(len==replies[i].len, "%s -> %d (expect %d)",
+               replies[i].name, len, replies[i].len);
+    }
+}
+
+static void testCheck(void)
+{
+    static const uint8_t crcexc[] = {0x01, 0x83, 0x02, 0xC0, 0xF1},
+                         lrcexc[] = {0x01, 0x83, 0x02, 0x7A},
+                         likelrc[] = {0x06, 0x86, 0x02, 0x72, 0x60};
+    uint8_t frame[8] = {0x01, 0x06, 0x21, 0x43, 0x56, 0x78};
+
+    testDiag("Testing rtu_check()");
+
+    testOk1(rtu_add_crc(frame, 6)==8);
+    testOk1(rtu_check(frame, 8)==0);
+    frame[3] ^= 1;
+    testOk1(rtu_check(frame, 8)!=0);
+
+    testOk1(rtu_check(crcexc, sizeof(crcexc))==0);
+    testOk1(rtu_check(lrcexc, sizeof(lrcexc))==0);
+    testOk1(rtu_check(likelrc, sizeof(likelrc))==0);
+    testOk1(rtu_check(crcexc, 4)!=0);
+    testOk1(rtu_check(frame, 3)!=0);
+}
+
+int main(int argc, char** argv)
+{
+    testPlan(NELEMENTS(replies)+8);
+
+    testReplyLen();
+    testCheck();
+
+    return testDone();
+}
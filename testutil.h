@@ -0,0 +1,114 @@
+/** Test harness for host test programs
+ * Copyright (C) 2013 Michael Davidsaver <mdavidsaver@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/* Prints "ok - ..." or "fail - ..." for each test, and a summary
+ * from testDone(), which is also the exit code of the program.
+ * A test program includes this once.
+ */
+
+static size_t npass, nfail, nplan;
+
+static inline void testDiag(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printf("# ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+static inline void testPassV(const char* fmt, va_list args)
+{
+    npass++;
+    printf("ok - ");
+    vprintf(fmt, args);
+    printf("\n");
+}
+
+static inline void testFailV(const char* fmt, va_list args)
+{
+    nfail++;
+    printf("fail - ");
+    vprintf(fmt, args);
+    printf("\n");
+}
+
+static inline void testPass(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    testPassV(fmt, args);
+    va_end(args);
+}
+
+static inline void testFail(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    testFailV(fmt, args);
+    va_end(args);
+}
+
+static inline int testOk(int v, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if(v)
+        testPassV(fmt, args);
+    else
+        testFailV(fmt, args);
+    va_end(args);
+    return v;
+}
+
+#define testOk1(X) testOk(X, #X)
+
+static inline void testPlan(size_t N)
+{
+    nplan = N;
+}
+
+//! Print summary.  Returns non-zero if any test failed, or the plan wasn't met
+static inline int testDone(void)
+{
+    printf("\n");
+    if(nplan && npass+nfail!=nplan) {
+        printf("Planned %lu tests but ran %lu\n",
+               (unsigned long)nplan,
+               (unsigned long)(npass+nfail));
+        nfail++;
+    }
+
+    printf("%lu test pass\n",
+           (unsigned long)(npass));
+
+    if(nfail) {
+        printf("%lu tests failed!\n",
+               (unsigned long)nfail);
+    }
+
+    return nfail!=0;
+}
+
+#endif // TESTUTIL_H